@@ -0,0 +1,105 @@
+#ifndef _ANIMATION_H
+#define _ANIMATION_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include "mathHelper.h"
+#include "transform.h"
+#include "camera.h"
+
+Point lerp (Point a, Point b, double t) {
+    return Point(a.x + (b.x - a.x) * t,
+                 a.y + (b.y - a.y) * t,
+                 a.z + (b.z - a.z) * t);
+}
+
+// e.g. frameFilename("frame_", 7) = "frame_0007.png"
+std::string frameFilename (std::string prefix, int frame) {
+    std::ostringstream name;
+    name << prefix << std::setw(4) << std::setfill('0') << frame << ".png";
+    return name.str();
+}
+
+/*
+ * The CameraPath class.
+ *
+ * Keyframes for the camera position and lookat, frames in between are
+ * linearly interpolated. Before the first and after the last keyframe the
+ * camera stays put.
+ */
+class CameraPath {
+    struct keyframe {
+        int frame;
+        Point position;
+        Point lookAt;
+
+        keyframe (int frame, Point position, Point lookAt) : frame(frame), position(position), lookAt(lookAt) {}
+    };
+
+    // always sorted by frame
+    std::vector<keyframe> keys;
+
+public:
+    void addKeyframe (int frame, Point position, Point lookAt) {
+        std::vector<keyframe>::iterator it = keys.begin();
+        while (it < keys.end() && it->frame < frame)
+            ++it;
+
+        keys.insert(it, keyframe(frame, position, lookAt));
+    }
+
+    void apply (Camera &cam, int frame) {
+        if (keys.empty())
+            return;
+
+        if (frame <= keys.front().frame) {
+            cam.setView(keys.front().position, keys.front().lookAt);
+            return;
+        }
+
+        for (unsigned int i = 1; i < keys.size(); ++i) {
+            if (frame <= keys[i].frame) {
+                keyframe &a = keys[i-1];
+                keyframe &b = keys[i];
+                double t = double(frame - a.frame) / double(b.frame - a.frame);
+
+                cam.setView(lerp(a.position, b.position, t), lerp(a.lookAt, b.lookAt, t));
+                return;
+            }
+        }
+
+        cam.setView(keys.back().position, keys.back().lookAt);
+    }
+};
+
+/*
+ * The Turntable class.
+ *
+ * Spins an instance around an axis going through a pivot, a fixed amount of
+ * degrees every frame, on top of the transform it had when the turntable was
+ * created.
+ */
+class Turntable {
+    Instance *instance;
+    Transform base;
+
+    Point pivot;
+    Vector axis;
+    double degreesPerFrame;
+
+public:
+    Turntable (Instance *instance, Point pivot, Vector axis, double degreesPerFrame) :
+        instance(instance), base(instance->getTransform()), pivot(pivot), axis(axis), degreesPerFrame(degreesPerFrame) {}
+
+    void apply (int frame) {
+        Transform spin = Transform::translation(pivot.x, pivot.y, pivot.z)
+                       * Transform::rotation(frame * degreesPerFrame, axis)
+                       * Transform::translation(-pivot.x, -pivot.y, -pivot.z);
+
+        instance->setTransform(spin * base);
+    }
+};
+
+#endif
@@ -5,8 +5,22 @@
 #include "mathHelper.h"
 #include "world.h"
 
-#include <future>
-#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <mutex>
+#include "threadPool.h"
+#include "toneReproduction.h"
+#include "framebuffer.h"
+
+// side of the square tiles for tiled rendering, in pixels
+#define TILE_SIZE 64
+
+// pixels traced together by renderWavefront
+#define WAVEFRONT_BATCH 16384
 
 class Camera {
     // camera'ss position
@@ -46,43 +60,146 @@ class Camera {
     // number of rays we will use per pixel
     int raysPerPixel;
 
-    // This function is given the world and the pixel, it will return the color
-    // of that pixel. In other words i ranges from [0,imageWidth] and
-    // j ranges from [0,imageHeight]
-    Color getColorInPixel(World world, int i, int j) {
-        // ray direction
-        double dx,dy,dz;
+    // adaptive sampling, off unless setUpAdaptiveSampling is called
+    bool adaptive = false;
+    int minSamples, maxSamples;
+    double errorThreshold;
 
-        // Color average
-        Color average;
+    // Rays shot during one render, shared by the threads. The budget is the
+    // same as the fixed sampling would use (raysPerPixel for every pixel).
+    struct SampleBudget {
+        std::atomic<long> spent;
+        std::atomic<long> pixelsLeft;
+        long total;
 
+        SampleBudget (long pixelNum, long raysPerPixel) : spent(0), pixelsLeft(pixelNum), total(pixelNum * raysPerPixel) {}
+    };
+
+    // One jittered ray through pixel (i,j)
+    Color samplePixel(World &world, int i, int j) {
+        return world.spawn( primaryRay(i, j) , MAX_DEPTH );
+    }
+
+    Ray primaryRay(int i, int j) {
         double startx = (firstPixelx + i * unitsWidth);
         double starty = (firstPixely - j * unitsHigh);
 
-        for(int a = 0; a < raysPerPixel; ++a) {
-            double randx = static_cast <double> (rand()) / (static_cast <double> (RAND_MAX/unitsWidth));
-            double randy = static_cast <double> (rand()) / (static_cast <double> (RAND_MAX/unitsHigh));
+        double randx = static_cast <double> (rand()) / (static_cast <double> (RAND_MAX/unitsWidth));
+        double randy = static_cast <double> (rand()) / (static_cast <double> (RAND_MAX/unitsHigh));
 
-            dx = startx + randx ;
-            dy = starty - randy ;
-            dz = focalLength;
+        // ray direction
+        double dx = startx + randx ;
+        double dy = starty - randy ;
+        double dz = focalLength;
 
-            Vector dir = dx*u + dy*v - dz*w;
-            normalize(dir);
+        Vector dir = dx*u + dy*v - dz*w;
+        normalize(dir);
 
-            // ray
-            Ray ray(position, dir);
+        // ray
+        return Ray(position, dir);
+    }
+
+    // angle one pixel covers, the World grows the texture footprint by it
+    // along the rays
+    double pixelSpread() {
+        return unitsWidth / focalLength;
+    }
+
+    // This function is given the world and the pixel, it will return the color
+    // of that pixel. In other words i ranges from [0,imageWidth] and
+    // j ranges from [0,imageHeight]
+    Color getColorInPixel(World &world, int i, int j) {
+        return getColorInPixel(world, i, j, raysPerPixel);
+    }
+
+    Color getColorInPixel(World &world, int i, int j, int rays) {
+        // Color average
+        Color average;
 
+        for(int a = 0; a < rays; ++a) {
             // Color average
-            average += world.spawn( ray , MAX_DEPTH );
+            average += samplePixel(world, i, j);
         }
 
         // get final color, if grid need to average
-        average = (average / static_cast <double> (raysPerPixel));
+        average = (average / static_cast <double> (rays));
 
         return average;
     }
 
+    // Adaptive version: minSamples rays first, then more only while the
+    // standard error of the pixel's luminance is above errorThreshold (relative
+    // to the luminance itself), up to maxSamples. Extra rays come out of the
+    // render's budget: each pixel gets an even share of what is left when it
+    // starts, so the pixels done first can't use up what the rest would need,
+    // and what the quiet pixels don't use is shared by the ones after them.
+    Color getColorInPixelAdaptive(World &world, int i, int j, SampleBudget &budget) {
+        Color sum;
+        double mean = 0, m2 = 0; // running luminance mean and squared deviations
+        int n = 0;
+
+        long share = (budget.total - budget.spent) / std::max(budget.pixelsLeft.load(), 1L);
+        share = std::min(std::max(share, long(minSamples)), long(maxSamples));
+
+        while (n < maxSamples) {
+            if (n >= minSamples) {
+                // need two for a variance
+                if (n >= 2) {
+                    double variance = m2 / (n - 1);
+                    double error = std::sqrt(variance / n);
+                    if (error <= errorThreshold * (mean + 0.001))
+                        break;
+                }
+
+                if (n >= share)
+                    break;
+            }
+
+            Color c = samplePixel(world, i, j);
+            sum += c;
+            ++n;
+            budget.spent++;
+
+            double l = luminance(c);
+            double delta = l - mean;
+            mean += delta / n;
+            m2 += delta * (l - mean);
+        }
+
+        budget.pixelsLeft--;
+
+        return sum / static_cast <double> (n);
+    }
+
+    // progressive rendering, per pixel sums over every pass so far
+    std::vector<Color> accumulated;
+    std::vector<double> luminanceSquares;
+    std::vector<int> samplesTaken;
+
+    // where pixel (i,j) is in the color maps, column after column like the
+    // single threaded render fills them
+    int pixelIndex (int i, int j) {
+        return i * imageHeight + j;
+    }
+
+    // body(index) for every pixel index, on the pool with MULTI_THREADED
+    template <typename F>
+    void forEachPixel (int pixelNum, F body) {
+        #ifdef MULTI_THREADED
+            threadPool().parallelFor(0, pixelNum, body, imageWidth);
+        #else
+            for (int index = 0; index < pixelNum; ++index)
+                body(index);
+        #endif
+    }
+
+    Color shadePixel(World &world, int i, int j, SampleBudget &budget) {
+        if (adaptive)
+            return getColorInPixelAdaptive(world, i, j, budget);
+        else
+            return getColorInPixel(world, i, j);
+    }
+
 public:
 
     // rayType = if we are doing ray tracing or ray marching
@@ -99,62 +216,374 @@ public:
         firstPixelx = -viewPlaneWidth*0.5;
         firstPixely = viewPlaneHeigth*0.5;
 
-        // defining the viewing coordinates
-        // oposite direction to help calculations
+        calculateViewCoordinates();
+
+        MAX_DEPTH = depthOrSamples;
+    }
+
+    // defining the viewing coordinates
+    // oposite direction to help calculations
+    void calculateViewCoordinates() {
         w = Vector(lookAt,position,true);
         normalize(w);
         u = cross(up,w);
         normalize(u);
         v = cross(w,u);
+    }
 
-        MAX_DEPTH = depthOrSamples;
+    // For animations, move the camera between frames
+    void setView(Point pos, Point look) {
+        position = pos;
+        lookAt = look;
+        calculateViewCoordinates();
+    }
+
+    Point getPosition() {
+        return position;
+    }
+
+    Point getLookAt() {
+        return lookAt;
+    }
+
+    int getImageWidth() {
+        return imageWidth;
+    }
+
+    int getImageHeight() {
+        return imageHeight;
+    }
+
+    // Instead of raysPerPixel rays everywhere, flat pixels stop after
+    // minSamples and noisy ones (edges, soft shadows) get up to maxSamples, as
+    // long as the image overall stays within raysPerPixel rays per pixel
+    void setUpAdaptiveSampling(int newMinSamples, int newMaxSamples, double newErrorThreshold) {
+        adaptive = true;
+        minSamples = std::max(newMinSamples, 1);
+        maxSamples = std::max(newMaxSamples, minSamples);
+        errorThreshold = newErrorThreshold;
+    }
+
+    // Progressive rendering: every pass adds one more ray to each pixel, so
+    // there is a whole (noisy) image after the first pass that only gets
+    // better. resetProgressive starts over, e.g. after the camera moved.
+    void resetProgressive () {
+        int pixelNum = imageWidth * imageHeight;
+
+        accumulated.assign(pixelNum, Color());
+        luminanceSquares.assign(pixelNum, 0.0);
+        samplesTaken.assign(pixelNum, 0);
     }
 
-    std::vector<Color> render (World world) {
+    int getPassesDone () {
+        if (samplesTaken.empty())
+            return 0;
+        return *std::min_element(samplesTaken.begin(), samplesTaken.end());
+    }
+
+    // One ray for every pixel. Once the deadline has passed the rest of the
+    // pixels are skipped, except on the first pass so every pixel has a color.
+    void renderPass (World &world, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        world.setPixelSpread(pixelSpread());
+
+        if (accumulated.empty())
+            resetProgressive();
+
+        bool firstPass = (getPassesDone() == 0);
+
+        forEachPixel(imageWidth * imageHeight, [&](int index) {
+            if (!firstPass && std::chrono::steady_clock::now() > deadline)
+                return;
+
+            int i = index / imageHeight;
+            int j = index % imageHeight;
+            Color c = samplePixel(world, i, j);
+            double l = luminance(c);
+
+            accumulated[index] += c;
+            luminanceSquares[index] += l * l;
+            samplesTaken[index]++;
+        });
+    }
+
+    // the image so far, black before the first pass
+    std::vector<Color> snapshot () {
+        std::vector<Color> colorMap(imageWidth * imageHeight);
+
+        for (unsigned int index = 0; index < accumulated.size(); ++index) {
+            if (samplesTaken[index] > 0)
+                colorMap[index] = accumulated[index] / static_cast <double> (samplesTaken[index]);
+        }
+
+        return colorMap;
+    }
+
+    // Average over the pixels of the standard error of their luminance,
+    // relative to the luminance (same measure as the adaptive sampling).
+    // Unknown (1) until every pixel has two rays.
+    double noiseLevel () {
+        if (getPassesDone() < 2)
+            return 1.0;
+
+        double total = 0;
+        for (unsigned int index = 0; index < accumulated.size(); ++index) {
+            double n = samplesTaken[index];
+            double mean = luminance(accumulated[index]) / n;
+            double variance = std::max(0.0, (luminanceSquares[index] - n * mean * mean) / (n - 1));
+
+            total += std::sqrt(variance / n) / (mean + 0.001);
+        }
+
+        return total / accumulated.size();
+    }
+
+    // Passes until 'seconds' are up (0 = no time limit), the noise level is
+    // down to noiseTarget (0 = no target) or maxPasses are done (0 = no
+    // limit), whatever comes first. onPass is called with the snapshot after
+    // every pass, e.g. to show a preview. Continues what earlier calls did,
+    // resetProgressive to start over.
+    std::vector<Color> renderProgressive (World &world, double seconds, double noiseTarget = 0.0, int maxPasses = 0,
+                                          std::function<void(const std::vector<Color>&)> onPass = nullptr) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+        if (seconds > 0)
+            deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+        std::cout << "Status: Progressive rendering." << std::endl;
+
+        int passes = 0;
+        double noise = noiseLevel();
+
+        while (true) {
+            renderPass(world, deadline);
+            passes++;
+            noise = noiseLevel();
+
+            if (onPass)
+                onPass(snapshot());
+
+            if (std::chrono::steady_clock::now() >= deadline)
+                break;
+            if (noiseTarget > 0 && noise <= noiseTarget)
+                break;
+            if (maxPasses > 0 && passes >= maxPasses)
+                break;
+        }
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Status: " << getPassesDone() << " rays per pixel in " << elapsed << " seconds, noise level " << noise << "." << std::endl;
+
+        return snapshot();
+    }
+
+    // Renders only the pixels x0 <= i < x0 + width, y0 <= j < y0 + height
+    // (clipped to the image), with 'samples' rays each or the camera's own
+    // sampling if 0. The result holds just the region, column after column,
+    // use mergeRegion to put it in a full frame.
+    std::vector<Color> renderRegion (World &world, int x0, int y0, int width, int height, int samples = 0) {
+        world.setPixelSpread(pixelSpread());
+
+        clipRegion(x0, y0, width, height);
+
+        int pixelNum = width * height;
+        std::vector<Color> region(pixelNum);
+
+        SampleBudget budget(pixelNum, raysPerPixel);
+
+        forEachPixel(pixelNum, [&](int index) {
+            int i = x0 + index / height;
+            int j = y0 + index % height;
+
+            if (samples > 0)
+                region[index] = getColorInPixel(world, i, j, samples);
+            else
+                region[index] = shadePixel(world, i, j, budget);
+        });
+
+        return region;
+    }
+
+    // copies a region from renderRegion (same x0, y0, width, height) over
+    // those pixels of a full frame from render
+    void mergeRegion (std::vector<Color> &colorMap, const std::vector<Color> &region, int x0, int y0, int width, int height) {
+        clipRegion(x0, y0, width, height);
+
+        for (int i = 0; i < width; ++i) {
+            for (int j = 0; j < height; ++j) {
+                colorMap[pixelIndex(x0 + i, y0 + j)] = region[i * height + j];
+            }
+        }
+    }
+
+    // keeps a region inside the image, width or height end up 0 if it is
+    // completely outside
+    void clipRegion (int &x0, int &y0, int &width, int &height) {
+        int x1 = std::min(x0 + width, imageWidth);
+        int y1 = std::min(y0 + height, imageHeight);
+
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+
+        width = std::max(x1 - x0, 0);
+        height = std::max(y1 - y0, 0);
+    }
+
+    // Same image as render, traced with World::traceWavefront. The rays of
+    // WAVEFRONT_BATCH pixels (all their samples) go through it at a time.
+    std::vector<Color> renderWavefront (World &world) {
+        world.setPixelSpread(pixelSpread());
+
+        std::cout << "Status: Using wavefront ray tracer." << std::endl;
+
+        int pixelNum = imageWidth * imageHeight;
+        std::vector<Color> colorMap(pixelNum);
+
+        for (int first = 0; first < pixelNum; first += WAVEFRONT_BATCH) {
+            int last = std::min(first + WAVEFRONT_BATCH, pixelNum);
+
+            std::vector<Ray> rays;
+            std::vector<int> pixels;
+
+            for (int index = first; index < last; ++index) {
+                int i = index / imageHeight;
+                int j = index % imageHeight;
+
+                for (int a = 0; a < raysPerPixel; ++a) {
+                    rays.push_back( primaryRay(i, j) );
+                    pixels.push_back( index );
+                }
+            }
+
+            world.traceWavefront(rays, pixels, MAX_DEPTH, 1.0 / raysPerPixel, colorMap);
+        }
+
+        return colorMap;
+    }
+
+    // Renders tile by tile and gives back the image ready to be shown, 8 bit
+    // sRGB RGBA row after row (see Canvas::setPixels). Tiles go in a scattered
+    // order so the RunningToneMap key settles early, from then on each tile
+    // is tone mapped (perceptual operator) and quantized as soon as it is
+    // done. The ones done before wait for the key.
+    std::vector<unsigned char> renderToneMapped (World &world, double Lmax) {
+        world.setPixelSpread(pixelSpread());
+
+        std::cout << "Status: Rendering tiles, tone mapped as they finish." << std::endl;
+
+        int pixelNum = imageWidth * imageHeight;
+
+        // x0, y0, width, height of each tile
+        std::vector<std::vector<int> > tiles;
+        for (int x = 0; x < imageWidth; x += TILE_SIZE)
+            for (int y = 0; y < imageHeight; y += TILE_SIZE)
+                tiles.push_back( {x, y, std::min(TILE_SIZE, imageWidth - x), std::min(TILE_SIZE, imageHeight - y)} );
+
+        std::mt19937 generator(1);
+        std::shuffle(tiles.begin(), tiles.end(), generator);
+
+        std::vector<unsigned char> rgba(pixelNum * 4, 255);
+        std::vector<std::vector<Color> > colors(tiles.size());
+
+        RunningToneMap toneMap(Lmax, pixelNum);
+        SampleBudget budget(pixelNum, raysPerPixel);
+
+        // tiles waiting for the key
+        std::mutex pendingMutex;
+        std::vector<int> pending;
+
+        auto quantizeTile = [&](int t) {
+            std::vector<int> &tile = tiles[t];
+
+            for (int i = 0; i < tile[2]; ++i) {
+                for (int j = 0; j < tile[3]; ++j) {
+                    int x = tile[0] + i;
+                    int y = tile[1] + j;
+
+                    quantizeSRGB( toneMap.map( colors[t][i * tile[3] + j] ), x, y, true, &rgba[(y * imageWidth + x) * 4] );
+                }
+            }
+
+            std::vector<Color>().swap(colors[t]);
+        };
+
+        auto renderTile = [&](int t) {
+            std::vector<int> &tile = tiles[t];
+            colors[t].resize(tile[2] * tile[3]);
+
+            for (int i = 0; i < tile[2]; ++i)
+                for (int j = 0; j < tile[3]; ++j)
+                    colors[t][i * tile[3] + j] = shadePixel(world, tile[0] + i, tile[1] + j, budget);
+
+            if ( toneMap.addTile(colors[t]) ) {
+                std::vector<int> waiting;
+                {
+                    std::unique_lock<std::mutex> lock(pendingMutex);
+                    waiting.swap(pending);
+                }
+
+                for (unsigned int w = 0; w < waiting.size(); ++w)
+                    quantizeTile(waiting[w]);
+
+                quantizeTile(t);
+            } else {
+                std::unique_lock<std::mutex> lock(pendingMutex);
+                pending.push_back(t);
+            }
+        };
+
+        #ifdef MULTI_THREADED
+            threadPool().parallelFor(0, tiles.size(), renderTile, 1);
+        #else
+            for (unsigned int t = 0; t < tiles.size(); ++t)
+                renderTile(t);
+        #endif
+
+        // the key never settled, or some tiles came in right as it did
+        toneMap.freeze();
+        for (unsigned int w = 0; w < pending.size(); ++w)
+            quantizeTile(pending[w]);
+
+        return rgba;
+    }
+
+    // Shades every pixel of the image, column after column, and hands each
+    // color to store(i, j, color) as it is done. The world is only read
+    // while rendering, so the same one (and its trees) can be rendered over
+    // and over, e.g. for every frame of an animation
+    template <typename F>
+    void renderPixels (World &world, F store) {
+        world.setPixelSpread(pixelSpread());
+
         // Size of canvas
         int pixelNum = imageWidth * imageHeight;
 
+        SampleBudget budget(pixelNum, raysPerPixel);
+
         #ifdef MULTI_THREADED
             std::cout << "Status: Using multi threaded ray tracer." << std::endl;
 
-            int cores = std::thread::hardware_concurrency();
-            volatile std::atomic<int> count(0);
-            volatile std::atomic<double> tenPercentIncrement(0.01);
-            std::vector<std::future<void> > futureVector;
-
-            // Result color of a ray
-            std::vector<Color> colorMap(pixelNum);
-
-            while (cores--) {
-                futureVector.push_back(
-                    std::async([=, &colorMap, &world, &count, &tenPercentIncrement]()
-                    {
-                        while (true) {
-                            int index = count++;
-                            if (index >= pixelNum)
-                                break;
-                            #ifdef SHOW_PROGRESS
-                                if (index > pixelNum * tenPercentIncrement) {
-                                    std::cout << "Status: Image processing: " << 100 * tenPercentIncrement << "% complete..." << std::endl;
-                                    tenPercentIncrement = 0.01 + tenPercentIncrement;
-                                }
-                            #endif
-                            int i = index / imageWidth;
-                            int j = index % imageWidth;
-                            colorMap[index] = getColorInPixel(world,i,j);
-
-                        }
-                    }));
-            }
+            std::atomic<int> count(0);
+            std::atomic<double> tenPercentIncrement(0.01);
+
+            // the shared pool, so no threads are started per render
+            threadPool().parallelFor(0, pixelNum, [&](int index) {
+                #ifdef SHOW_PROGRESS
+                    if (++count > pixelNum * tenPercentIncrement) {
+                        std::cout << "Status: Image processing: " << 100 * tenPercentIncrement << "% complete..." << std::endl;
+                        tenPercentIncrement = 0.01 + tenPercentIncrement;
+                    }
+                #endif
+                int i = index / imageHeight;
+                int j = index % imageHeight;
+                store(i, j, shadePixel(world,i,j,budget));
+            }, imageWidth);
         #else
             std::cout << "Status: Using single thread ray tracer." << std::endl;
 
             int count = 0;
             double tenPercentIncrement = 0.01;
 
-            // Result color of a ray
-            std::vector<Color> colorMap;
-
             // this loop is going like
             // consider origin at top left
             // fixate column
@@ -163,7 +592,7 @@ public:
 
             for(int i = 0; i < imageWidth; ++i) {
                 for(int j = 0; j < imageHeight; ++j) {
-                    colorMap.push_back( getColorInPixel(world,i,j) );
+                    store(i, j, shadePixel(world,i,j,budget));
                     #ifdef SHOW_PROGRESS
                         count++;
                         if (count > pixelNum * tenPercentIncrement) {
@@ -175,9 +604,30 @@ public:
             }
         #endif
 
-        // will return a vector with imageWidth * imageHeight values, use it to paint the canvas
+        if (adaptive) {
+            std::cout << "Status: Adaptive sampling used " << double(budget.spent) / pixelNum << " rays per pixel." << std::endl;
+        }
+    }
+
+    // will return a vector with imageWidth * imageHeight values, pixel (i,j)
+    // at pixelIndex(i,j), for the tone operators that work on a color map
+    std::vector<Color> render (World &world) {
+        std::vector<Color> colorMap(imageWidth * imageHeight);
+
+        renderPixels(world, [&](int i, int j, const Color &c) {
+            colorMap[pixelIndex(i, j)] = c;
+        });
+
         return colorMap;
     }
+
+    // straight into the framebuffer, which must be imageWidth x imageHeight
+    template <typename T>
+    void render (World &world, Framebuffer<T> &framebuffer) {
+        renderPixels(world, [&](int i, int j, const Color &c) {
+            framebuffer.set(i, j, c);
+        });
+    }
 };
 
 #endif
@@ -1,6 +1,9 @@
 #ifndef _CANVAS_H
 #define _CANVAS_H
 
+#include <string>
+#include <vector>
+
 #include <SFML/Graphics/Color.hpp>
 #include <SFML/Graphics/Image.hpp>
 #include <SFML/Graphics/RenderWindow.hpp>
@@ -67,8 +70,13 @@ public:
         myImage.setPixel (x, y, sf::Color (R, G, B));
     }
 
-    void savePicture() {
-        myImage.saveToFile("test.png");
+    // the whole image at once, 8 bit RGBA row after row
+    void setPixels ( const std::vector<unsigned char> &rgba ) {
+        myImage.create( width, height, &rgba[0] );
+    }
+
+    void savePicture(std::string filename = "test.png") {
+        myImage.saveToFile(filename);
     }
 };
 
@@ -0,0 +1,315 @@
+#ifndef _DISTRIBUTED_H
+#define _DISTRIBUTED_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <chrono>
+#include <thread>
+
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "mathHelper.h"
+#include "world.h"
+#include "camera.h"
+#include "threadPool.h"
+
+// a worker that takes longer than this on one tile is taken as hung, it is
+// killed and the tile goes to the others
+#define TILE_TIMEOUT_SECONDS 600
+
+/*
+ * The DistributedRender class.
+ *
+ * A coordinator and N worker processes. The workers are forked once the
+ * scene is set up, so each one has the whole world (and its trees) without
+ * loading anything again. Each one gets its own thread pool with its share
+ * of the cores. The coordinator hands out tiles over a socket to each
+ * worker, one at a time, and pastes the results in the frame. When a worker
+ * dies or hangs on a tile, the tile goes back in the queue for the others.
+ *
+ * Messages are plain streams of ints and doubles, so the same protocol
+ * works over a TCP socket to another machine, the local socket pairs are
+ * the stand-in for that.
+ */
+class DistributedRender {
+    struct tile {
+        int x0, y0, width, height;
+
+        tile (int x0 = 0, int y0 = 0, int width = 0, int height = 0) : x0(x0), y0(y0), width(width), height(height) {}
+    };
+
+    typedef std::chrono::steady_clock clock;
+
+    struct worker {
+        pid_t pid;
+        int socket;
+
+        // the tile it is on, width == 0 if idle, and when it must be done
+        tile current;
+        clock::time_point deadline;
+        bool alive;
+    };
+
+    Camera &cam;
+    World &world;
+
+    int numWorkers;
+    int samples;
+
+    std::vector<worker> workers;
+
+    // false if the other side is gone. MSG_NOSIGNAL so a dead worker doesn't
+    // kill the coordinator with SIGPIPE when it is written to
+    static bool sendAll (int fd, const void *data, size_t size) {
+        const char *p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool receiveAll (int fd, void *data, size_t size) {
+        char *p = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t n = read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // What each forked process runs: render every tile it is sent and send
+    // back the colors, until it gets an empty tile or the coordinator is gone
+    void workerLoop (int fd) {
+        // the jitter of the rays must not be the same in every worker
+        srand(getpid() ^ time(0));
+
+        int cores = std::thread::hardware_concurrency();
+        restartThreadPoolAfterFork(std::max(cores / numWorkers, 1));
+
+        while (true) {
+            int header[4];
+            if (!receiveAll(fd, header, sizeof(header)) || header[2] == 0)
+                break;
+
+            std::vector<Color> region = cam.renderRegion(world, header[0], header[1], header[2], header[3], samples);
+
+            std::vector<double> data;
+            for (std::vector<Color>::iterator it = region.begin() ; it < region.end() ; ++it) {
+                data.push_back(it->r);
+                data.push_back(it->g);
+                data.push_back(it->b);
+            }
+
+            if (!sendAll(fd, header, sizeof(header)) || !sendAll(fd, &data[0], data.size() * sizeof(double)))
+                break;
+        }
+
+        close(fd);
+        _exit(0);
+    }
+
+    void startWorkers () {
+        for (int n = 0; n < numWorkers; ++n) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                std::cerr << "Error: could not create socket for worker " << n << "." << std::endl;
+                exit(1);
+            }
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                std::cerr << "Error: could not start worker " << n << "." << std::endl;
+                exit(1);
+            }
+
+            if (pid == 0) {
+                close(fds[0]);
+
+                // sockets of the workers started before this one
+                for (unsigned int i = 0; i < workers.size(); ++i)
+                    close(workers[i].socket);
+
+                workerLoop(fds[1]);
+            }
+
+            close(fds[1]);
+
+            worker w;
+            w.pid = pid;
+            w.socket = fds[0];
+            w.alive = true;
+            workers.push_back(w);
+        }
+    }
+
+    // next tile from the queue to w, false if the worker is gone
+    bool assign (worker &w, std::deque<tile> &queue) {
+        w.current = queue.front();
+        w.deadline = clock::now() + std::chrono::seconds(TILE_TIMEOUT_SECONDS);
+        queue.pop_front();
+
+        int header[4] = { w.current.x0, w.current.y0, w.current.width, w.current.height };
+        return sendAll(w.socket, header, sizeof(header));
+    }
+
+    void lose (worker &w, std::deque<tile> &queue) {
+        if (w.current.width > 0)
+            queue.push_front(w.current);
+
+        w.current = tile();
+        w.alive = false;
+        close(w.socket);
+        waitpid(w.pid, NULL, 0);
+    }
+
+    int aliveWorkers () {
+        int count = 0;
+        for (unsigned int i = 0; i < workers.size(); ++i)
+            if (workers[i].alive)
+                count++;
+        return count;
+    }
+
+public:
+    // samples = rays per pixel for every tile, 0 for the camera's own sampling
+    DistributedRender (Camera &cam, World &world, int numWorkers, int samples = 0) :
+        cam(cam), world(world), numWorkers(numWorkers), samples(samples) {}
+
+    std::vector<Color> render () {
+        int imageWidth = cam.getImageWidth();
+        int imageHeight = cam.getImageHeight();
+
+        std::cout << "Status: Rendering tiles on " << numWorkers << " worker processes." << std::endl;
+
+        std::deque<tile> queue;
+        for (int x = 0; x < imageWidth; x += TILE_SIZE)
+            for (int y = 0; y < imageHeight; y += TILE_SIZE)
+                queue.push_back(tile(x, y, std::min(TILE_SIZE, imageWidth - x), std::min(TILE_SIZE, imageHeight - y)));
+
+        int tilesLeft = queue.size();
+        std::vector<Color> colorMap(imageWidth * imageHeight);
+
+        startWorkers();
+
+        while (tilesLeft > 0) {
+            // idle workers get the next tiles
+            for (unsigned int i = 0; i < workers.size(); ++i) {
+                worker &w = workers[i];
+                while (w.alive && w.current.width == 0 && !queue.empty()) {
+                    if (!assign(w, queue)) {
+                        std::cerr << "Warning: worker " << w.pid << " died, its tile goes to the others." << std::endl;
+                        lose(w, queue);
+                    }
+                }
+            }
+
+            if (aliveWorkers() == 0) {
+                std::cerr << "Error: all workers died, " << tilesLeft << " tiles were not rendered." << std::endl;
+                exit(1);
+            }
+
+            // wait for any busy worker to answer, or the first deadline
+            std::vector<pollfd> fds;
+            std::vector<int> busy;
+            clock::time_point first = clock::time_point::max();
+            for (unsigned int i = 0; i < workers.size(); ++i) {
+                if (workers[i].alive && workers[i].current.width > 0) {
+                    pollfd p;
+                    p.fd = workers[i].socket;
+                    p.events = POLLIN;
+                    p.revents = 0;
+                    fds.push_back(p);
+                    busy.push_back(i);
+                    first = std::min(first, workers[i].deadline);
+                }
+            }
+
+            long long wait = std::chrono::duration_cast<std::chrono::milliseconds>(first - clock::now()).count();
+            int timeout = int(std::min(std::max(wait, 0LL), 60000LL));
+
+            if (poll(&fds[0], fds.size(), timeout) < 0) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "Error: waiting on the workers failed." << std::endl;
+                exit(1);
+            }
+
+            for (unsigned int k = 0; k < fds.size(); ++k) {
+                worker &w = workers[busy[k]];
+
+                if (fds[k].revents == 0) {
+                    if (clock::now() >= w.deadline) {
+                        std::cerr << "Warning: worker " << w.pid << " is stuck, its tile goes to the others." << std::endl;
+                        kill(w.pid, SIGKILL);
+                        lose(w, queue);
+                    }
+                    continue;
+                }
+
+                tile t = w.current;
+
+                int header[4];
+                std::vector<double> data(t.width * t.height * 3);
+
+                if (!receiveAll(w.socket, header, sizeof(header)) || !receiveAll(w.socket, &data[0], data.size() * sizeof(double))) {
+                    std::cerr << "Warning: worker " << w.pid << " died, its tile goes to the others." << std::endl;
+                    lose(w, queue);
+                    continue;
+                }
+
+                // the pixels must be of the tile it was given
+                if (header[0] != t.x0 || header[1] != t.y0 || header[2] != t.width || header[3] != t.height) {
+                    std::cerr << "Warning: worker " << w.pid << " sent a tile it wasn't given, its tile goes to the others." << std::endl;
+                    kill(w.pid, SIGKILL);
+                    lose(w, queue);
+                    continue;
+                }
+
+                std::vector<Color> region(t.width * t.height);
+                for (unsigned int p = 0; p < region.size(); ++p)
+                    region[p] = Color(data[3*p], data[3*p + 1], data[3*p + 2]);
+
+                cam.mergeRegion(colorMap, region, t.x0, t.y0, t.width, t.height);
+
+                w.current = tile();
+                tilesLeft--;
+            }
+        }
+
+        // an empty tile tells the workers to stop
+        for (unsigned int i = 0; i < workers.size(); ++i) {
+            if (workers[i].alive) {
+                int header[4] = { 0, 0, 0, 0 };
+                sendAll(workers[i].socket, header, sizeof(header));
+                close(workers[i].socket);
+                waitpid(workers[i].pid, NULL, 0);
+            }
+        }
+        workers.clear();
+
+        return colorMap;
+    }
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _FRAMEBUFFER_H
+#define _FRAMEBUFFER_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "mathHelper.h"
+#include "half.h"
+#include "threadPool.h"
+
+// entries of the linear to sRGB table, fine enough that dithering hides the
+// steps in the darks
+#define SRGB_TABLE_SIZE 4096
+
+// 8 bit sRGB of linear values in [0,1], times 255 and not rounded yet
+const std::vector<float>& srgbTable () {
+    static std::vector<float> table = [] () {
+        std::vector<float> t(SRGB_TABLE_SIZE);
+        for (int i = 0; i < SRGB_TABLE_SIZE; ++i) {
+            double v = double(i) / (SRGB_TABLE_SIZE - 1);
+            double s = (v <= 0.0031308) ? 12.92 * v : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+            t[i] = float(255.0 * s);
+        }
+        return t;
+    } ();
+
+    return table;
+}
+
+// Ordered dithering threshold of pixel (x,y), 4x4 Bayer matrix, in (0,1).
+// Deterministic, so tiles can be quantized in any order.
+inline float ditherThreshold ( int x, int y ) {
+    static const int bayer[16] = {  0,  8,  2, 10,
+                                   12,  4, 14,  6,
+                                    3, 11,  1,  9,
+                                   15,  7, 13,  5 };
+    return (bayer[(y & 3) * 4 + (x & 3)] + 0.5f) / 16.0f;
+}
+
+// one linear channel, display value in [0,1] (clamped), to 8 bit sRGB
+inline unsigned char quantizeSRGB ( float v, float threshold ) {
+    const std::vector<float> &table = srgbTable();
+
+    v = std::min(std::max(v, 0.0f), 1.0f);
+    float s = table[int(v * (SRGB_TABLE_SIZE - 1) + 0.5f)];
+
+    return (unsigned char)std::min(s + threshold, 255.0f);
+}
+
+// pixel (x,y) of color c into an RGBA pixel, with dithering if asked
+inline void quantizeSRGB ( const Color &c, int x, int y, bool dither, unsigned char *pixel ) {
+    float threshold = dither ? ditherThreshold(x, y) : 0.5f;
+
+    pixel[0] = quantizeSRGB(float(c.r), threshold);
+    pixel[1] = quantizeSRGB(float(c.g), threshold);
+    pixel[2] = quantizeSRGB(float(c.b), threshold);
+    pixel[3] = 255;
+}
+
+/*
+ * The Framebuffer class.
+ *
+ * Colors of an image, row after row: pixel (x,y) is at y * width + x, its r,
+ * g and b next to each other. Stored as float, or as Half to take half the
+ * memory. The camera can render straight into one, and toSRGB8 turns it into
+ * what Canvas::setPixels takes in one pass.
+ */
+template <typename T>
+class Framebuffer {
+    int width, height;
+    std::vector<T> data;
+
+public:
+    Framebuffer ( int width, int height ) : width(width), height(height), data(3 * width * height) {}
+
+    int getWidth () const {
+        return width;
+    }
+
+    int getHeight () const {
+        return height;
+    }
+
+    void set ( int x, int y, const Color &c ) {
+        T *p = &data[3 * (y * width + x)];
+        p[0] = T(float(c.r));
+        p[1] = T(float(c.g));
+        p[2] = T(float(c.b));
+    }
+
+    Color get ( int x, int y ) const {
+        const T *p = &data[3 * (y * width + x)];
+        return Color(float(p[0]), float(p[1]), float(p[2]));
+    }
+
+    // 8 bit sRGB RGBA, each color multiplied by scale on the way (see the
+    // color map version below). Rows are read and written in order, bands
+    // of them in parallel.
+    std::vector<unsigned char> toSRGB8 ( double scale = 1.0, bool dither = true ) const {
+        std::vector<unsigned char> rgba(4 * width * height);
+        float s = float(scale);
+
+        auto quantizeRow = [&](int y) {
+            const T *in = &data[3 * y * width];
+            unsigned char *out = &rgba[4 * y * width];
+
+            for (int x = 0; x < width; ++x) {
+                float threshold = dither ? ditherThreshold(x, y) : 0.5f;
+
+                out[4*x]     = quantizeSRGB(s * float(in[3*x]), threshold);
+                out[4*x + 1] = quantizeSRGB(s * float(in[3*x + 1]), threshold);
+                out[4*x + 2] = quantizeSRGB(s * float(in[3*x + 2]), threshold);
+                out[4*x + 3] = 255;
+            }
+        };
+
+        #ifdef MULTI_THREADED
+            threadPool().parallelFor(0, height, quantizeRow, 16);
+        #else
+            for (int y = 0; y < height; ++y)
+                quantizeRow(y);
+        #endif
+
+        return rgba;
+    }
+};
+
+// The color map as the camera renders it (column after column, pixel (x,y)
+// at x * height + y) straight to 8 bit sRGB RGBA, row after row, as
+// Canvas::setPixels takes it. Each color is multiplied by scale on the way,
+// so a tone operator that is one scale for the whole image (the perceptual
+// one) needs no pass of its own. Bands of rows are done in parallel, each
+// one column at a time so the color map is read in order.
+std::vector<unsigned char> toSRGB8 ( const std::vector<Color> &colorMap, int width, int height, double scale = 1.0, bool dither = true ) {
+    std::vector<unsigned char> rgba(4 * width * height);
+
+    auto quantizeBand = [&](int band) {
+        int y0 = band * 16;
+        int y1 = std::min(y0 + 16, height);
+
+        for (int x = 0; x < width; ++x) {
+            const Color *in = &colorMap[x * height];
+
+            for (int y = y0; y < y1; ++y)
+                quantizeSRGB( scale * in[y], x, y, dither, &rgba[4 * (y * width + x)] );
+        }
+    };
+
+    int bands = (height + 15) / 16;
+
+    #ifdef MULTI_THREADED
+        threadPool().parallelFor(0, bands, quantizeBand, 1);
+    #else
+        for (int band = 0; band < bands; ++band)
+            quantizeBand(band);
+    #endif
+
+    return rgba;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef _HALF_H
+#define _HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * The Half class.
+ *
+ * 16 bit (IEEE half precision) float, only for storage: it converts to and
+ * from float, all the math is done on those. Good for about 3 decimal digits
+ * between 6e-5 and 65504, plenty for colors.
+ */
+struct Half {
+    uint16_t bits;
+
+    Half () : bits(0) {}
+
+    Half ( float f ) : bits(fromFloat(f)) {}
+
+    operator float () const {
+        return toFloat(bits);
+    }
+
+    // rounds to the nearest half, ties to even
+    static uint16_t fromFloat ( float f ) {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+
+        uint32_t sign = (x >> 16) & 0x8000;
+        int floatExp = (x >> 23) & 0xff;
+        uint32_t mant = x & 0x7fffff;
+
+        // infinity and nan
+        if (floatExp == 0xff)
+            return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+        int exp = floatExp - 127 + 15;
+
+        // too big, infinity
+        if (exp >= 31)
+            return sign | 0x7c00;
+
+        // too small for a normal half, subnormal or zero
+        if (exp <= 0) {
+            if (exp < -10)
+                return sign;
+
+            mant |= 0x800000;
+            int shift = 14 - exp;
+            uint32_t h = mant >> shift;
+            uint32_t rest = mant & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+
+            if (rest > halfway || (rest == halfway && (h & 1)))
+                h++;
+
+            return sign | h;
+        }
+
+        // a carry out of the mantissa goes into the exponent, which is right
+        uint32_t h = sign | (exp << 10) | (mant >> 13);
+        uint32_t rest = mant & 0x1fff;
+
+        if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+            h++;
+
+        return h;
+    }
+
+    static float toFloat ( uint16_t h ) {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        int exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        uint32_t x;
+
+        if (exp == 0) {
+            if (mant == 0) {
+                x = sign;
+            } else {
+                // subnormal, normalize it for the float
+                exp = 1;
+                while (!(mant & 0x400)) {
+                    mant <<= 1;
+                    exp--;
+                }
+                mant &= 0x3ff;
+                x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+            }
+        } else if (exp == 31) {
+            x = sign | 0x7f800000 | (mant << 13);
+        } else {
+            x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        }
+
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+};
+
+#endif
@@ -2,81 +2,76 @@
 #define _ILLUMINATIONMODEL_H
 
 #include <vector>
+#include <map>
 #include <algorithm>    // std::max
 #include "mathHelper.h"
 #include "object.h"
 #include "lightSource.h"
 
-Color ambientComponent(Object *obj, Color ambientLight, Point point) {
-    Color objColor = obj->getColor(point);
+// the illumination models a World can be set up with
+#define ILLUMINATION_NONE 0
+#define ILLUMINATION_PHONG 1
+#define ILLUMINATION_PHONG_BLINN 2
+#define ILLUMINATION_LAMBERT 3
+
+// each light the shadow rays reached, with the points on it they got to
+typedef std::map<LightSource*, std::vector<Point> > LightsReached;
+
+// objColor, here and in illuminate, is the object's color at the point,
+// looked up once by the caller for both
+Color ambientComponent(Object *obj, const Color &objColor) {
     double ka = obj->getKa();
 
     return ka * objColor;
 }
 
-// needs the object because we will use diffuse and specular color,
-// here we will not calculate the ambient component
-// the light list is the lights that the shadow array definetly hit
-Color illuminatePhong(Object *obj, Vector view, Point point, Vector normal,
-    std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap) {
-    if (lightsAndPointsReachedMap.empty())
-        return Color(0,0,0);
-
-    Color diffuse, diffuseFinal;
-    Color specular, specularFinal;
-
-    Color objColor = obj->getColor(point);
-    Color objSpecColor = obj->getSpecularColor();
+// The models only differ in the specular term: how much of the light coming
+// from s (normalized, towards the light) is reflected along view. They are
+// the policy of illuminate below, so each model gets its own loop with the
+// term inlined, and a model without one (Lambert) doesn't do that work.
 
-    double kd = obj->getKd();
-    double ks = obj->getKs();
-    double ke = obj->getKe();
+struct PhongModel {
+    static const bool specular = true;
 
-    normalize(view);
-    normalize(normal);
+    static double specularTerm(Vector s, const Vector &view, const Vector &normal, double ke) {
+        Vector r = reflect ( -1.0 * s, normal, VECTOR_INCOMING );
+        normalize(r);
 
-    // For each light, for each point reached on the light
-    for (std::map<LightSource*, std::vector<Point> >::iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
-        LightSource *lightHit = (it->first);
-        std::vector<Point> pointsHit = (it->second);
-
-        double attenuation = lightHit->getAttenuation(point);
-        Color lightRadiance = lightHit->getColor();
-        double numSamples = lightHit->getNumSamplesOnSurface();
+        return std::pow( std::max(dot( r, view ), 0.0), ke );
+    }
+};
 
-        for(std::vector<Point>::iterator it2 = pointsHit.begin() ; it2 < pointsHit.end() ; ++it2) {
-            // diffuse
-            Vector s(point, (*it2), true);
-            double sn = std::max(dot( s, normal ),0.0);
+struct PhongBlinnModel {
+    static const bool specular = true;
 
-            // spec
-            Vector invs((*it2), point, true);
-            Vector r = reflect ( invs, normal, VECTOR_INCOMING );
-            normalize(r);
+    static double specularTerm(Vector s, const Vector &view, const Vector &normal, double ke) {
+        Vector h = s + view;
+        normalize(h);
 
-            double rvke = std::pow( std::max(dot( r, view ), 0.0), ke );
+        return std::pow( std::max(dot( normal, h ), 0.0), ke );
+    }
+};
 
-            // calculate it
-            diffuse += lightRadiance * objColor * sn * attenuation;
-            specular += lightRadiance * objSpecColor * rvke * attenuation;
-        }
+// diffuse only, for matte scenes
+struct LambertModel {
+    static const bool specular = false;
 
-        diffuseFinal += diffuse / numSamples;
-        specularFinal += specular / numSamples;
+    static double specularTerm(Vector, const Vector &, const Vector &, double) {
+        return 0.0;
     }
+};
 
-    return kd * diffuseFinal + ks * specularFinal;
-}
-
-Color illuminatePhongBlinn(Object *obj, Vector view, Point point, Vector normal,
-    std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap) {
+// needs the object because we will use diffuse and specular color,
+// here we will not calculate the ambient component
+// the light list is the lights that the shadow array definetly hit
+template <typename Model>
+Color illuminate(Object *obj, Vector view, const Point &point, Vector normal, const LightsReached &lightsAndPointsReachedMap, const Color &objColor) {
     if (lightsAndPointsReachedMap.empty())
         return Color(0,0,0);
 
     Color diffuse, diffuseFinal;
     Color specular, specularFinal;
 
-    Color objColor = obj->getColor(point);
     Color objSpecColor = obj->getSpecularColor();
 
     double kd = obj->getKd();
@@ -87,28 +82,24 @@ Color illuminatePhongBlinn(Object *obj, Vector view, Point point, Vector normal,
     normalize(normal);
 
     // For each light, for each point reached on the light
-    for (std::map<LightSource*, std::vector<Point> >::iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
+    for (LightsReached::const_iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
         LightSource *lightHit = (it->first);
-        std::vector<Point> pointsHit = (it->second);
+        const std::vector<Point> &pointsHit = (it->second);
 
         double attenuation = lightHit->getAttenuation(point);
         Color lightRadiance = lightHit->getColor();
         double numSamples = lightHit->getNumSamplesOnSurface();
 
-        for(std::vector<Point>::iterator it2 = pointsHit.begin() ; it2 < pointsHit.end() ; ++it2) {
+        for(std::vector<Point>::const_iterator it2 = pointsHit.begin() ; it2 < pointsHit.end() ; ++it2) {
             // diffuse
             Vector s(point, (*it2), true);
             double sn = std::max(dot( s, normal ),0.0);
 
-            // spec
-            Vector h = s + view;
-            normalize(h);
-
-            double rvke = std::pow( std::max(dot( normal, h ), 0.0), ke );
-
             // calculate it
             diffuse += lightRadiance * objColor * sn * attenuation;
-            specular += lightRadiance * objSpecColor * rvke * attenuation;
+
+            if (Model::specular)
+                specular += lightRadiance * objSpecColor * Model::specularTerm(s, view, normal, ke) * attenuation;
         }
 
         diffuseFinal += diffuse / numSamples;
@@ -116,7 +107,6 @@ Color illuminatePhongBlinn(Object *obj, Vector view, Point point, Vector normal,
     }
 
     return kd * diffuseFinal + ks * specularFinal;
-
 }
 
 #endif
@@ -2,8 +2,23 @@
 #define _KDTREE_H
 
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <typeinfo>
 #include "object.h"
 #include "mathHelper.h"
+#include "threadPool.h"
+
+// past this depth we stop splitting even if a leaf is still crowded, e.g. many
+// instances overlapping the same spot would never get under the limit
+#define KD_MAX_DEPTH 24
+
+// a leaf with fewer objects than this is not split
+#define KD_LEAF_SIZE 30
+
+// with MULTI_THREADED, nodes above this depth build one of their halves as a
+// task on the thread pool
+#define KD_PARALLEL_DEPTH 4
 
 class Kdtree {
 
@@ -20,54 +35,103 @@ class Kdtree {
         // then subdiv happens at x = 4
         double subdivVal;
 
+        // how deep in the tree this node is
+        int depth;
+
         // List of objects in this node
         std::vector<Object*> objectList;
 
+        // the same objects split by type, so a leaf tests each type in its own
+        // loop with direct calls the compiler can inline. Anything that is not
+        // exactly one of these (instances, meshes) goes in 'others'
+        std::vector<Sphere*> spheres;
+        std::vector<Triangle*> triangles;
+        std::vector<Rectangle*> rectangles;
+        std::vector<Object*> others;
+
         // Voxel
         Voxel v;
 
-        node *front;
-        node *rear;
+        // the children belong to their parent, so the whole tree goes away
+        // with the root
+        std::unique_ptr<node> front;
+        std::unique_ptr<node> rear;
 
         // default
         node(){}
 
         // this constructor to make a interior node
-        node (int subdiv, double subdivVal, Voxel v, node *newFront, node *newRear) : subdiv(subdiv), subdivVal(subdivVal), v(v) {
+        node (int subdiv, double subdivVal, Voxel v, std::unique_ptr<node> newFront, std::unique_ptr<node> newRear) : subdiv(subdiv), subdivVal(subdivVal), v(v) {
             leaf = false;
 
-            this->front = newFront;
-            this->rear = newRear;
+            this->front = std::move(newFront);
+            this->rear = std::move(newRear);
         }
 
         // use this construction to make a leaf node
-        // all you need is the object list
-        node (std::vector<Object*> objectList, Voxel v) : objectList(objectList), v(v) {
+        // all you need is the object list, subdiv and depth are where a split
+        // would continue if the leaf gets too crowded later
+        node (std::vector<Object*> objectList, Voxel v, int subdiv, int depth) : subdiv(subdiv), depth(depth), objectList(objectList), v(v) {
             leaf = true;
+            groupByType();
+        }
+
+        void groupByType () {
+            spheres.clear();
+            triangles.clear();
+            rectangles.clear();
+            others.clear();
+
+            for(std::vector<Object*>::iterator it = objectList.begin() ; it < objectList.end() ; ++it) {
+                const std::type_info &type = typeid(**it);
+
+                if (type == typeid(Sphere))
+                    spheres.push_back(static_cast<Sphere*>(*it));
+                else if (type == typeid(Triangle))
+                    triangles.push_back(static_cast<Triangle*>(*it));
+                else if (type == typeid(Rectangle))
+                    rectangles.push_back(static_cast<Rectangle*>(*it));
+                else
+                    others.push_back(*it);
+            }
         }
     };
 
-    node *root;
+    std::unique_ptr<node> root;
 
 public:
 
     // default constructor
-    Kdtree(){
-        root = NULL;
-    }
+    Kdtree(){}
 
     // constructor
     Kdtree (std::vector<Object*> objectList , Voxel V) {
-        root = buildKdTree(objectList, V, SUBDIV_X);
+        build(objectList, V);
+    }
+
+    // the tree owns its nodes: it can be moved but not copied, and freeing
+    // the root frees the whole tree
+    Kdtree ( const Kdtree& ) = delete;
+    Kdtree& operator= ( const Kdtree& ) = delete;
+
+    Kdtree ( Kdtree&& ) = default;
+    Kdtree& operator= ( Kdtree&& ) = default;
+
+    ~Kdtree () = default;
+
+    // Replaces whatever tree there was with one over objectList, the old
+    // nodes are freed
+    void build (std::vector<Object*> objectList , Voxel V) {
+        root = buildKdTree(objectList, V, SUBDIV_X, 0);
     }
 
     bool exists () {
         return !(root == NULL);
     }
 
-    node* buildKdTree (std::vector<Object*> objectList, Voxel V, int currentSubdiv) {
-        if (terminate(objectList)) {
-            return new node(objectList, V);
+    std::unique_ptr<node> buildKdTree (std::vector<Object*> objectList, Voxel V, int currentSubdiv, int depth) {
+        if (terminate(objectList) || depth >= KD_MAX_DEPTH) {
+            return std::unique_ptr<node>(new node(objectList, V, currentSubdiv, depth));
         }
 
         // partition plane -> spatial median
@@ -90,106 +154,192 @@ public:
         // new subdiv
         int newSubDiv = (currentSubdiv + 1) % 3;
 
-        return new node (currentSubdiv, V.splitVal(currentSubdiv), V,
-            buildKdTree(objectListFront, vFront, newSubDiv), buildKdTree(objectListRear, vRear, newSubDiv) );
+        #ifdef MULTI_THREADED
+            // the first levels build their front half on the pool
+            if (depth < KD_PARALLEL_DEPTH && objectListFront.size() >= KD_LEAF_SIZE) {
+                std::future<std::unique_ptr<node> > front = threadPool().submit([=] () {
+                    return buildKdTree(objectListFront, vFront, newSubDiv, depth + 1);
+                });
+                std::unique_ptr<node> rear = buildKdTree(objectListRear, vRear, newSubDiv, depth + 1);
+
+                return std::unique_ptr<node>(new node (currentSubdiv, V.splitVal(currentSubdiv), V, threadPool().get(front), std::move(rear)));
+            }
+        #endif
+
+        return std::unique_ptr<node>(new node (currentSubdiv, V.splitVal(currentSubdiv), V,
+            buildKdTree(objectListFront, vFront, newSubDiv, depth + 1), buildKdTree(objectListRear, vRear, newSubDiv, depth + 1) ));
+    }
+
+    // Objects in the leaf whose voxel holds p, p is assumed to be inside the
+    // root voxel (e.g. a point where something in the tree was hit)
+    std::vector<Object*>& leafObjects (Point p) {
+        node *n = root.get();
+
+        while (!n->leaf) {
+            double val = (n->subdiv == SUBDIV_X) ? p.x : (n->subdiv == SUBDIV_Y) ? p.y : p.z;
+            n = (val >= n->subdivVal) ? n->front.get() : n->rear.get();
+        }
+
+        return n->objectList;
     }
 
     bool terminate (std::vector<Object*> objectList) {
-        return (objectList.size() < 30);
+        return (objectList.size() < KD_LEAF_SIZE);
     }
 
-    Object* traverse (Ray ray) {
-        return traverse (ray, root);
+    // For dynamic scenes: take obj out of every leaf touching the box it used
+    // to be in. Nothing else in the tree changes.
+    void remove (Object *obj, Voxel oldBounds) {
+        remove(obj, oldBounds, root.get());
     }
 
-    Object* traverseForLight (Ray ray, LightSource* lightSource) {
-        return traverseForLight (ray, root, lightSource);
+    // Add obj to every leaf it is inside of. A leaf that gets twice as crowded
+    // as the build allows is rebuilt on its own, the rest of the tree stays.
+    void insert (Object *obj) {
+        insert(obj, root.get());
     }
 
-    // Will return the closest object the ray hits, or NULL if it doesn't hit anything
-    Object* traverse (Ray ray, node *n) {
-        // if it's a leaf, try intersectoins
+    void remove (Object *obj, Voxel &oldBounds, node *n) {
+        if ( !(n->v).overlaps(oldBounds) )
+            return;
+
         if (n->leaf) {
-            Point originRay = ray.getOrigin();
-            Point intersection;
+            std::vector<Object*> &list = n->objectList;
+            list.erase(std::remove(list.begin(), list.end(), obj), list.end());
+            n->groupByType();
+            return;
+        }
 
-            std::vector<Point> vPoint;
-            std::vector<double> vDist;
+        remove(obj, oldBounds, n->front.get());
+        remove(obj, oldBounds, n->rear.get());
+    }
 
-            // we will go through the objects in the voxel and look for intersections
-            for(std::vector<Object*>::iterator it = n->objectList.begin() ; it < n->objectList.end() ; ++it) {
-                intersection = (*it)->intersect(ray);
-                vPoint.push_back( intersection );
-                vDist.push_back( distance(originRay, intersection) );
+    void insert (Object *obj, node *n) {
+        if ( !obj->isInside(n->v) )
+            return;
+
+        if (n->leaf) {
+            n->objectList.push_back(obj);
+
+            if (n->objectList.size() >= 2 * KD_LEAF_SIZE && n->depth < KD_MAX_DEPTH) {
+                std::unique_ptr<node> rebuilt = buildKdTree(n->objectList, n->v, n->subdiv, n->depth);
+                *n = std::move(*rebuilt);
+            } else {
+                n->groupByType();
             }
+            return;
+        }
 
-            // we find the minimum distance on vDist, which would be closest intersection
-            int objHit( indexMinElement(vDist) );
+        insert(obj, n->front.get());
+        insert(obj, n->rear.get());
+    }
 
-            if (objHit == -1) {
-                return NULL;
+    // Calls T's own intersect, not through the vtable, so it can be inlined.
+    // Plain Objects still go through the virtual call.
+    static Point intersectDirect (Sphere *obj, Ray &ray) { return obj->Sphere::intersect(ray); }
+    static Point intersectDirect (Triangle *obj, Ray &ray) { return obj->Triangle::intersect(ray); }
+    static Point intersectDirect (Rectangle *obj, Ray &ray) { return obj->Rectangle::intersect(ray); }
+    static Point intersectDirect (Object *obj, Ray &ray) { return obj->intersect(ray); }
+
+    // keeps the closest hit and where it is (distance 0 means no intersection)
+    template <typename T>
+    static void closestHit (std::vector<T*> &list, Ray &ray, Point &originRay, Object* &closest, double &closestDist, Point &closestPoint) {
+        for(typename std::vector<T*>::iterator it = list.begin() ; it < list.end() ; ++it) {
+            Point intersection = intersectDirect(*it, ray);
+            double dist = distance(originRay, intersection);
+
+            if (dist != 0 && (closest == NULL || dist < closestDist)) {
+                closest = *it;
+                closestDist = dist;
+                closestPoint = intersection;
             }
+        }
+    }
 
-            // obj hit
-            return n->objectList[objHit];
+    // first object that is hit before the light, emissive objects don't
+    // count, they are the lights
+    template <typename T>
+    static Object* firstBlocker (std::vector<T*> &list, Ray &ray, Point &originRay, double distOriginAndLight) {
+        for(typename std::vector<T*>::iterator it = list.begin() ; it < list.end() ; ++it) {
+            if ( (*it)->isEmissive() )
+                continue;
+
+            double dist = distance(originRay, intersectDirect(*it, ray));
+            if (dist != 0 && dist < distOriginAndLight)
+                return *it;
+        }
+        return NULL;
+    }
+
+    // Closest object the ray hits, NULL if none, hitPoint is set to where
+    Object* traverse (Ray ray, Point &hitPoint) {
+        double hitDist = 0;
+        return traverse (ray, root.get(), hitPoint, hitDist);
+    }
+
+    Object* traverseForLight (Ray ray, LightSource* lightSource) {
+        return traverseForLight (ray, root.get(), lightSource);
+    }
+
+    // Will return the closest object the ray hits, or NULL if it doesn't hit
+    // anything. The point and distance of the hit come back with it, so
+    // nobody has to intersect the object again
+    Object* traverse (Ray &ray, node *n, Point &hitPoint, double &hitDist) {
+        // if it's a leaf, try intersectoins, one type at a time
+        if (n->leaf) {
+            Point originRay = ray.getOrigin();
+
+            Object* closest = NULL;
+            hitDist = 0;
+
+            closestHit(n->spheres, ray, originRay, closest, hitDist, hitPoint);
+            closestHit(n->triangles, ray, originRay, closest, hitDist, hitPoint);
+            closestHit(n->rectangles, ray, originRay, closest, hitDist, hitPoint);
+            closestHit(n->others, ray, originRay, closest, hitDist, hitPoint);
+
+            return closest;
         }
 
         if ( (n->v).intersect(ray, 0, 1000) ) {
-            Object *a = traverse(ray, n->rear);
-            Object *b = traverse(ray, n->front);
-            Point origin = ray.getOrigin();
+            Point pointA, pointB;
+            double distA = 0, distB = 0;
 
-            if (a == NULL || b == NULL) {
-                return (a == NULL) ? b : a;
-            } else {
-                double distRayA = distance(origin, a->intersect(ray));
-                double distRayB = distance(origin, b->intersect(ray));
+            Object *a = traverse(ray, n->rear.get(), pointA, distA);
+            Object *b = traverse(ray, n->front.get(), pointB, distB);
 
-                // they are both zero, no intersection with the objects
-                if (distRayA == 0 && distRayB == 0) {
-                    return NULL;
-                } else if (distRayA < distRayB) {
-                    return a;
-                } else {
-                    return b;
-                }
+            if (a != NULL && (b == NULL || distA < distB)) {
+                hitPoint = pointA;
+                hitDist = distA;
+                return a;
             }
 
+            hitPoint = pointB;
+            hitDist = distB;
+            return b;
         }
         return NULL;
     }
 
     Object* traverseForLight (Ray ray, node *n, LightSource* lightSource) {
-        // if it's a leaf, try intersectoins
+        // if it's a leaf, look for anything between the origin and the light
         if (n->leaf) {
             Point originRay = ray.getOrigin();
-            Point intersection;
-
-            std::vector<Point> vPoint;
-            std::vector<double> vDist;
-
             double distOriginAndLight = lightSource->getMinDistance(originRay);
-            
-            // we will go through the objects in the voxel and look for intersections
-            std::vector<Object*>::iterator it;
-            for(it = n->objectList.begin() ; it < n->objectList.end() ; ++it) {
-                double distOriginIntersection = distance(originRay, (*it)->intersect(ray));
-                if ( !(*it)->isEmissive() && distOriginIntersection != 0 && distOriginIntersection < distOriginAndLight) {
-                    break;
-                }
-            }
 
-            if ( it == n->objectList.end() ) { // if it went through the whole loop, then it hits the light!
-                return NULL;
-            }
+            Object* blocker = NULL;
+
+            if (blocker == NULL) blocker = firstBlocker(n->spheres, ray, originRay, distOriginAndLight);
+            if (blocker == NULL) blocker = firstBlocker(n->triangles, ray, originRay, distOriginAndLight);
+            if (blocker == NULL) blocker = firstBlocker(n->rectangles, ray, originRay, distOriginAndLight);
+            if (blocker == NULL) blocker = firstBlocker(n->others, ray, originRay, distOriginAndLight);
 
-            // obj hit
-            return (*it);
+            // NULL if nothing was in the way, then it hits the light!
+            return blocker;
         }
 
         if ( (n->v).intersect(ray, 0, 1000) ) {
-            Object *a = traverseForLight(ray, n->rear, lightSource);
-            Object *b = traverseForLight(ray, n->front, lightSource);
+            Object *a = traverseForLight(ray, n->rear.get(), lightSource);
+            Object *b = traverseForLight(ray, n->front.get(), lightSource);
             Point origin = ray.getOrigin();
 
             if (a == NULL || b == NULL) {
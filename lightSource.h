@@ -72,8 +72,13 @@ class SpotLight : public LightSource {
     double angle;
     double aExp; // attenuation exponent;
 
+    // M = dir * dir^T - cos^2(angle) * I, used for the ray/cone intersection
+    Mat3 cone;
+
 public:
-    SpotLight( Point position, Color color, Vector dir, double angle, double aExp = 0 ) : LightSource(position, color), dir(dir), angle(angle), aExp(aExp) {}
+    SpotLight( Point position, Color color, Vector dir, double angle, double aExp = 0 ) : LightSource(position, color), dir(dir), angle(angle), aExp(aExp) {
+        cone = Mat3::outer(dir, dir) - std::pow(std::cos(angle * PI / 180.0f),2) * Mat3::identity();
+    }
 
     std::vector<Point> getPos () {
         return std::vector<Point>(1,position);
@@ -108,24 +113,15 @@ public:
         Vector direction = ray.getDirection();
         normalize(direction);
 
-        // here we will turn some vectors in matrixes for calculations
-
-        double deltaVals[] = {origin.x-position.x,origin.y-position.y,origin.z-position.z};
-        Matrix delta(3,1,deltaVals);
+        // the cone matrix is fixed for the light, only the quadratic forms
+        // depend on the ray
+        Vector delta(position, origin);
 
-        Matrix d(dir);
-        Matrix u(direction);
-
-        Matrix m = d * d.transpose() - std::pow(std::cos(angle * PI / 180.0f),2) * indentityMatrix();
-        Matrix mc2 = u.transpose() * m * u; // matrix with one row and one col
-        Matrix mc1 = u.transpose() * m * delta; // matrix with one row and one col
-        Matrix mc0 = delta.transpose() * m * delta; // matrix with one row and one col
+        double c2 = cone.quadratic(direction, direction);
+        double c1 = cone.quadratic(direction, delta);
+        double c0 = cone.quadratic(delta, delta);
 
         double w1, w2;
-        double c0 = mc0[0];
-        double c1 = mc1[0];
-        double c2 = mc2[0];
-
         double c1c1minusc0c2 = c1 * c1 - c0 * c2;
 
         if ( c1c1minusc0c2 == 0 ) {
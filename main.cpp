@@ -11,6 +11,35 @@
 #define MULTI_THREADED
 //#define CANVAS_DISPLAY
 //#define SHOW_PROGRESS
+//#define ADAPTIVE_SAMPLING
+
+// trace batches of rays stage by stage instead of pixel by pixel
+//#define WAVEFRONT
+
+// tone map and quantize tiles as they finish, instead of after the frame
+//#define TONE_MAP_TILES
+
+// keep adding passes until the time is up or the image is clean enough
+//#define PROGRESSIVE
+#define PROGRESSIVE_SECONDS 60
+
+// keep the rendered image in 16 bit halfs instead of floats, half the memory
+//#define HALF_FRAMEBUFFER
+
+// only trace this rectangle of pixels, the rest of the image stays black
+//#define CROP
+#define CROP_X 384
+#define CROP_Y 384
+#define CROP_WIDTH 256
+#define CROP_HEIGHT 256
+
+// split the image in tiles rendered by separate worker processes
+//#define DISTRIBUTED
+#define DISTRIBUTED_WORKERS 4
+
+// render an animation instead of a single frame, writes frame_0000.png ...
+//#define SEQUENCE
+#define SEQUENCE_FRAMES 300
 
 // define for scenes
 //#define CLASSIC
@@ -28,8 +57,12 @@
 #include "illuminationModel.h"
 #include "proceduralTexture.h"
 #include "toneReproduction.h"
+#include "framebuffer.h"
 
 #include "readPly.h"
+#include "mesh.h"
+#include "animation.h"
+#include "distributed.h"
 #include "kdtree.h"
 
 // pixels
@@ -40,6 +73,36 @@ int imageWidth = 1024;
 double viewPlaneHeigth = 0.25;
 double viewPlaneWidth = 0.25;
 
+// tone reproduction, then the whole image goes to the canvas as 8 bit sRGB.
+// The perceptual operator is one scale, applied while quantizing; the
+// others change the color map in place first. key is the log average
+// luminance to tone map with, 0 to take it from the whole color map.
+void paintCanvas ( Canvas &canvas, std::vector<Color> &colorMap, double key = 0 ) {
+    if (key == 0)
+        key = logAverage(colorMap, 1000);
+
+    double scale = perceptualScale( key, 1000 );
+    //toneMapPhotographic(colorMap , 1000); scale = 1;
+    //toneMapLocal(colorMap , imageWidth, imageHeight, 1000); scale = 1;
+
+    canvas.setPixels( toSRGB8( colorMap, imageWidth, imageHeight, scale ) );
+}
+
+// what the camera renders into when no color map is needed
+#ifdef HALF_FRAMEBUFFER
+    typedef Framebuffer<Half> RenderBuffer;
+#else
+    typedef Framebuffer<float> RenderBuffer;
+#endif
+
+// same with an image the camera rendered into, only the perceptual operator
+// (the others need the color map, see above)
+void paintCanvas ( Canvas &canvas, const RenderBuffer &framebuffer ) {
+    double scale = perceptualScale( logAverage(framebuffer, 1000), 1000 );
+
+    canvas.setPixels( framebuffer.toSRGB8( scale ) );
+}
+
 int main ( void ) {
     // set up random number seed
     srand (static_cast <unsigned> (time(0)));
@@ -200,8 +263,16 @@ int main ( void ) {
 
     #ifdef CLOSE_UP_BUNNY
 
-    // Get the triangles from the bunny fily
-    std::vector<Triangle> bunny = readPlyFile("plyFiles/bun_zipper_res4", Color(0.2125,0.1275,0.054));
+    // Get the triangles from the bunny fily, the mesh builds its own tree once
+    Mesh bunnyMesh( readPlyFile("plyFiles/bun_zipper_res4", Color(0.2125,0.1275,0.054)), Color(0.2125,0.1275,0.054) );
+    bunnyMesh.setUpPhong( Color(0.714,0.4284,0.18144), 1, 1, 0.8, 0.1 );
+
+    // a solid texture over the whole mesh instead of the flat color
+    // MarbleTexture bunnyMarble( Color(0.2125,0.1275,0.054), Color(0.8,0.7,0.6), 40 );
+    // bunnyMesh.setUpProceduralTexture(&bunnyMarble);
+
+    // place it in the world
+    Instance bunny( &bunnyMesh );
 
     // FLOOR
     std::vector<Point> vertices;
@@ -239,18 +310,11 @@ int main ( void ) {
 
     translate(&rectangleLightObj, -1, 2, -1);
 
-    for (unsigned int i = 0; i < bunny.size() ; ++i) {
-        scale(&bunny[i], 8, 8, 8);
-        translate(&bunny[i], 0, -1.29, -2);
-    }
+    scale(&bunny, 8, 8, 8);
+    translate(&bunny, 0, -1.29, -2);
 
     World world;
-
-    // Add the triangles from the bunny in the world
-    for (unsigned int i = 0; i < bunny.size() ; ++i) {
-        bunny[i].setUpPhong( Color(0.714,0.4284,0.18144), 1, 1, 0.8, 0.1 );
-        world.addObject(&bunny[i]);
-    }
+    world.addObject(&bunny);
     world.addObject(&floorRectangle);
     world.addObject(&forwardRectangle);
     world.addObject(&rectangleLightObj); // full white
@@ -399,6 +463,12 @@ int main ( void ) {
 
     #endif
 
+    #ifdef ADAPTIVE_SAMPLING
+        // flat pixels stop at 2 rays (1 if the budget runs short), noisy
+        // ones get up to 32
+        cam.setUpAdaptiveSampling(1, 32, 0.05);
+    #endif
+
     #ifdef KD_TREE
         std::cout << "Status: Using KD Tree." << std::endl;
         // Create Tree
@@ -407,49 +477,98 @@ int main ( void ) {
         std::cout << "Status: Using regular ray traversal." << std::endl;
     #endif
 
-    // render our world, get the color map we will put on canvas
-    std::vector<Color> colorMap = cam.render(world);
+    #ifdef SEQUENCE
+        // The world, its trees and the camera live through the whole animation,
+        // every frame only moves the camera and the instances around
+        CameraPath cameraPath;
+        cameraPath.addKeyframe(0, pos, lookAt);
+        cameraPath.addKeyframe(SEQUENCE_FRAMES - 1, Point(pos.x + 1.5, pos.y + 0.5, pos.z - 0.5), lookAt);
 
-    // Tone reproduction
-    std::vector<Color> toneReprodColorMap = compressionPerceptual(colorMap , 1000);
-    //std::vector<Color> toneReprodColorMap = colorMap;
+        #ifdef CLOSE_UP_BUNNY
+            Turntable turntable(&bunny, Point(0,-1,-2), Vector(0,1,0), 360.0 / SEQUENCE_FRAMES);
+        #endif
 
-    // SFML canvas and window
-    Canvas canvas( imageWidth, imageHeight );
-    sf::RenderWindow window(sf::VideoMode(imageWidth, imageHeight), "Ray Tracer");
+        Canvas canvas( imageWidth, imageHeight );
+        RenderBuffer framebuffer( imageWidth, imageHeight );
 
-    // set pixel values on the canvas
-    for(int i = 0; i < imageWidth; ++i) {
-        for(int j = 0; j < imageHeight; ++j) {
-            Color c = toneReprodColorMap[i * imageWidth + j];
-            canvas.setPixel( i, j, c.r, c.g, c.b );
-        }
-    }
-
-    #ifdef CANVAS_DISPLAY
-        // run the program as long as the window is open
-        while (window.isOpen())
-        {
-            // check all the window's events that were triggered since the last iteration of the loop
-            sf::Event event;
-            while (window.pollEvent(event))
-            {
-                // "close requested" event: we close the window
-                if (event.type == sf::Event::Closed)
-                    window.close();
-            }
+        for (int frame = 0; frame < SEQUENCE_FRAMES; ++frame) {
+            std::cout << "Status: Rendering frame " << frame + 1 << " of " << SEQUENCE_FRAMES << "." << std::endl;
 
-            // clear the window with black color
-            window.clear(sf::Color::Black);
+            cameraPath.apply(cam, frame);
+            #ifdef CLOSE_UP_BUNNY
+                turntable.apply(frame);
+            #endif
 
-            // draw everything here...
-            canvas.draw(window);
+            #ifdef KD_TREE
+                // only what moved is updated in the tree
+                world.refitKdTree();
+            #endif
 
-            // end the current frame
-            window.display();
+            cam.render(world, framebuffer);
+            paintCanvas( canvas, framebuffer );
+            canvas.savePicture( frameFilename("frame_", frame) );
         }
     #else
-        canvas.savePicture();
+        // SFML canvas and window
+        Canvas canvas( imageWidth, imageHeight );
+        sf::RenderWindow window(sf::VideoMode(imageWidth, imageHeight), "Ray Tracer");
+
+        #ifdef TONE_MAP_TILES
+            // tiles are tone mapped and quantized as they finish
+            canvas.setPixels( cam.renderToneMapped(world, 1000) );
+        #else
+            // render our world and put it on the canvas
+            #if defined(CROP)
+                std::vector<Color> colorMap( imageWidth * imageHeight );
+                std::vector<Color> region = cam.renderRegion(world, CROP_X, CROP_Y, CROP_WIDTH, CROP_HEIGHT);
+                cam.mergeRegion(colorMap, region, CROP_X, CROP_Y, CROP_WIDTH, CROP_HEIGHT);
+
+                // the key of the region alone, the black around it would make
+                // the crop much brighter than in the full render
+                paintCanvas( canvas, colorMap, logAverage(region, 1000) );
+            #elif defined(DISTRIBUTED)
+                DistributedRender distributed(cam, world, DISTRIBUTED_WORKERS);
+                std::vector<Color> colorMap = distributed.render();
+                paintCanvas( canvas, colorMap );
+            #elif defined(WAVEFRONT)
+                std::vector<Color> colorMap = cam.renderWavefront(world);
+                paintCanvas( canvas, colorMap );
+            #elif defined(PROGRESSIVE)
+                // stops sooner if the noise gets down to 1%
+                std::vector<Color> colorMap = cam.renderProgressive(world, PROGRESSIVE_SECONDS, 0.01);
+                paintCanvas( canvas, colorMap );
+            #else
+                RenderBuffer framebuffer( imageWidth, imageHeight );
+                cam.render(world, framebuffer);
+                paintCanvas( canvas, framebuffer );
+            #endif
+        #endif
+
+        #ifdef CANVAS_DISPLAY
+            // run the program as long as the window is open
+            while (window.isOpen())
+            {
+                // check all the window's events that were triggered since the last iteration of the loop
+                sf::Event event;
+                while (window.pollEvent(event))
+                {
+                    // "close requested" event: we close the window
+                    if (event.type == sf::Event::Closed)
+                        window.close();
+                }
+
+                // clear the window with black color
+                window.clear(sf::Color::Black);
+
+                // draw everything here...
+                canvas.draw(window);
+
+                // end the current frame
+                window.display();
+            }
+        #else
+            canvas.savePicture();
+        #endif
     #endif
 
     std::cout << "Status: Done." << std::endl;
@@ -0,0 +1,191 @@
+#ifndef _MATERIAL_H
+#define _MATERIAL_H
+
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include "mathHelper.h"
+#include "texture.h"
+#include "proceduralTexture.h"
+
+// index of a material in materialTable()
+typedef uint16_t MaterialId;
+
+/*
+ * The Material struct.
+ *
+ * Everything about how a surface looks: its color or texture, the phong
+ * values, emission and reflection/transmission. Objects don't keep one of
+ * their own, only the MaterialId of one in materialTable().
+ */
+struct Material {
+    Texture texture;
+
+    // solid/procedural texture, not owned. Takes over from the rest if set
+    ProceduralTexture *procedural = NULL;
+
+    // color, also ambient/diffuse for phong
+    Color col;
+
+    // other phong values
+    Color specular;
+    double ka = 0, kd = 0, ks = 0, ke = 1;
+
+    // emmisive 'material' for area lights
+    // if object is emissive, no need for any other color or value
+    bool emissive = false;
+    Color emissiveColor;
+
+    // values for reflection and transmission
+    double kr = 0, kt = 0;
+
+    // value for refraction
+    double nr = 1;
+
+    Material() {}
+
+    Material(Color col) : col(col) {}
+
+    Material(Texture texture) : texture(texture) {}
+
+    bool operator== (const Material &m) const {
+        return texture == m.texture && procedural == m.procedural
+            && sameColor(col, m.col) && sameColor(specular, m.specular)
+            && ka == m.ka && kd == m.kd && ks == m.ks && ke == m.ke
+            && emissive == m.emissive && sameColor(emissiveColor, m.emissiveColor)
+            && kr == m.kr && kt == m.kt && nr == m.nr;
+    }
+
+private:
+    static bool sameColor(const Color &a, const Color &b) {
+        return a.r == b.r && a.g == b.g && a.b == b.b;
+    }
+};
+
+// hash of all the fields operator== compares, for the table's index
+struct MaterialHash {
+    size_t operator() (const Material &m) const {
+        size_t h = m.texture.hash();
+        combine(h, std::hash<const void*>()(m.procedural));
+        combine(h, m.col);
+        combine(h, m.specular);
+        combine(h, m.ka);
+        combine(h, m.kd);
+        combine(h, m.ks);
+        combine(h, m.ke);
+        combine(h, size_t(m.emissive));
+        combine(h, m.emissiveColor);
+        combine(h, m.kr);
+        combine(h, m.kt);
+        combine(h, m.nr);
+        return h;
+    }
+
+private:
+    static void combine(size_t &h, size_t value) {
+        h ^= value + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+
+    static void combine(size_t &h, double value) {
+        combine(h, std::hash<double>()(value));
+    }
+
+    static void combine(size_t &h, const Color &c) {
+        combine(h, c.r);
+        combine(h, c.g);
+        combine(h, c.b);
+    }
+};
+
+/*
+ * The MaterialTable class.
+ *
+ * All the materials of the program. Adding one that is already there gives
+ * back the id of the existing one (found through a hash of its fields), so
+ * the triangles of a mesh made with the same color all share one record.
+ * A material can also be added once and its id given to objects with
+ * Object::setMaterial.
+ *
+ * The table counts the objects using each material: add counts one for the
+ * caller, acquire and release the others. A material no object uses any
+ * more (like the ones left behind by the setters) is dropped and its id
+ * reused, so the 65536 ids are only ever taken by materials in use.
+ * Materials are only added while setting up the scene, rendering just reads
+ * the table. Not thread safe.
+ *
+ * Use materialTable() to get the one shared by the whole program. Id 0 is
+ * the default material (black, no phong values), it is never dropped.
+ */
+class MaterialTable {
+    std::vector<Material> materials;
+    std::vector<int> users;
+    std::vector<MaterialId> freeIds;
+    std::unordered_map<Material, MaterialId, MaterialHash> index;
+
+public:
+    MaterialTable() {
+        materials.push_back(Material());
+        users.push_back(0);
+        index[materials[0]] = 0;
+    }
+
+    MaterialId add(const Material &m) {
+        std::unordered_map<Material, MaterialId, MaterialHash>::iterator it = index.find(m);
+        if (it != index.end()) {
+            acquire(it->second);
+            return it->second;
+        }
+
+        MaterialId id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+            materials[id] = m;
+        } else {
+            if (materials.size() > UINT16_MAX) {
+                std::cerr << "Error: Too many different materials in use, at most " << UINT16_MAX + 1 << "." << std::endl;
+                exit(1);
+            }
+
+            id = materials.size();
+            materials.push_back(m);
+            users.push_back(0);
+        }
+
+        index[m] = id;
+        acquire(id);
+        return id;
+    }
+
+    void acquire(MaterialId id) {
+        if (id != 0)
+            users[id]++;
+    }
+
+    void release(MaterialId id) {
+        if (id == 0 || --users[id] > 0)
+            return;
+
+        index.erase(materials[id]);
+        materials[id] = Material(); // lets go of its texture
+        freeIds.push_back(id);
+    }
+
+    Material& operator[](MaterialId id) {
+        return materials[id];
+    }
+
+    // materials in use, the default one included
+    int size() {
+        return materials.size() - freeIds.size();
+    }
+};
+
+MaterialTable& materialTable() {
+    static MaterialTable table;
+    return table;
+}
+
+#endif
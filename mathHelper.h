@@ -2,6 +2,8 @@
 #define _MATHHELPER_H
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
 
 // For voxels
 #define SUBDIV_X 0
@@ -210,7 +212,7 @@ struct Matrix {
 
     // Non-modifying arithematic operators
     Matrix transpose () {
-        double vals[row * col];
+        std::vector<double> vals(row * col);
 
         for( int k = 0; k < row * col; ++k ) {
             int i = k / row;
@@ -218,57 +220,218 @@ struct Matrix {
             vals[k] = matrix[col * j + i];
         }
 
-        return Matrix(col,row,vals);
+        return Matrix(col,row,vals.data());
     }
 
     Matrix operator+ (const Matrix& rhs) {
-        double vals[row * col];
+        std::vector<double> vals(row * col);
 
         for ( int i = 0; i < row * col; ++i )
             vals[i] = matrix[i] + rhs.matrix[i];
 
-        return Matrix(row, col, vals);
+        return Matrix(row, col, vals.data());
     }
 
     Matrix operator- (const Matrix& rhs) {
-        double vals[row * col];
+        std::vector<double> vals(row * col);
 
         for ( int i = 0; i < row * col; ++i )
             vals[i] = matrix[i] - rhs.matrix[i];
 
-        return Matrix(row, col, vals);
+        return Matrix(row, col, vals.data());
     }
 
     Matrix operator* (const Matrix& rhs) {
-        double vals[row * rhs.col];
+        std::vector<double> vals(row * rhs.col, 0.0);
 
         for (int i = 0; i < row; ++i) {
             for (int j = 0; j < rhs.col; ++j) {
-                vals[rhs.col*i+j] = 0;
                 for (int k = 0; k < rhs.row; ++k)
                     vals[i * rhs.col + j] += matrix[i * col + k] * rhs.matrix[k * rhs.col + j];
             }
         }
 
-        return Matrix(row, rhs.col, vals);
+        return Matrix(row, rhs.col, vals.data());
     }
 
     Matrix operator* (double rhs) {
-        double vals[row * col];
+        std::vector<double> vals(row * col);
 
         for ( int i = 0; i < row * col; ++i )
-            vals[i] *= rhs;
+            vals[i] = matrix[i] * rhs;
 
-        return Matrix(row,col,vals);
+        return Matrix(row,col,vals.data());
     }
 
     friend Matrix operator* (double lhs, const Matrix& rhs) {
-        double vals[rhs.row * rhs.col];
+        std::vector<double> vals(rhs.row * rhs.col);
 
         for ( int i = 0; i < rhs.row * rhs.col; ++i )
             vals[i] = lhs * rhs.matrix[i];
 
-        return Matrix(rhs.row,rhs.col,vals);
+        return Matrix(rhs.row,rhs.col,vals.data());
+    }
+};
+
+/*
+ * The Mat3 and Mat4 classes.
+ *
+ * Fixed size, row-major matrices for the hot paths (spot light cones, affine
+ * transforms). Unlike Matrix these never touch the heap, so they are cheap to
+ * build inside intersection code.
+ */
+
+struct Mat3 {
+    double m[9];
+
+    // zero matrix, or s on the diagonal
+    constexpr Mat3 ( double s = 0 ) : m{s,0,0, 0,s,0, 0,0,s} {}
+
+    constexpr Mat3 ( double a00, double a01, double a02,
+                     double a10, double a11, double a12,
+                     double a20, double a21, double a22 )
+        : m{a00,a01,a02, a10,a11,a12, a20,a21,a22} {}
+
+    constexpr double operator() (int i, int j) const {
+        return m[3 * i + j];
+    }
+
+    double& operator() (int i, int j) {
+        return m[3 * i + j];
+    }
+
+    static constexpr Mat3 identity () {
+        return Mat3(1);
+    }
+
+    // v * v^T
+    static Mat3 outer ( const Vector &v, const Vector &u ) {
+        return Mat3(v.x*u.x, v.x*u.y, v.x*u.z,
+                    v.y*u.x, v.y*u.y, v.y*u.z,
+                    v.z*u.x, v.z*u.y, v.z*u.z);
+    }
+
+    constexpr Mat3 transpose () const {
+        return Mat3(m[0], m[3], m[6],
+                    m[1], m[4], m[7],
+                    m[2], m[5], m[8]);
+    }
+
+    constexpr double determinant () const {
+        return m[0] * (m[4]*m[8] - m[5]*m[7])
+             - m[1] * (m[3]*m[8] - m[5]*m[6])
+             + m[2] * (m[3]*m[7] - m[4]*m[6]);
+    }
+
+    // Non-modifying arithematic operators
+    constexpr Mat3 operator+ (const Mat3& rhs) const {
+        return Mat3(m[0]+rhs.m[0], m[1]+rhs.m[1], m[2]+rhs.m[2],
+                    m[3]+rhs.m[3], m[4]+rhs.m[4], m[5]+rhs.m[5],
+                    m[6]+rhs.m[6], m[7]+rhs.m[7], m[8]+rhs.m[8]);
+    }
+
+    constexpr Mat3 operator- (const Mat3& rhs) const {
+        return Mat3(m[0]-rhs.m[0], m[1]-rhs.m[1], m[2]-rhs.m[2],
+                    m[3]-rhs.m[3], m[4]-rhs.m[4], m[5]-rhs.m[5],
+                    m[6]-rhs.m[6], m[7]-rhs.m[7], m[8]-rhs.m[8]);
+    }
+
+    constexpr Mat3 operator* (double rhs) const {
+        return Mat3(m[0]*rhs, m[1]*rhs, m[2]*rhs,
+                    m[3]*rhs, m[4]*rhs, m[5]*rhs,
+                    m[6]*rhs, m[7]*rhs, m[8]*rhs);
+    }
+
+    friend constexpr Mat3 operator* (double lhs, const Mat3& rhs) {
+        return rhs * lhs;
+    }
+
+    constexpr Mat3 operator* (const Mat3& rhs) const {
+        return Mat3(m[0]*rhs.m[0] + m[1]*rhs.m[3] + m[2]*rhs.m[6],
+                    m[0]*rhs.m[1] + m[1]*rhs.m[4] + m[2]*rhs.m[7],
+                    m[0]*rhs.m[2] + m[1]*rhs.m[5] + m[2]*rhs.m[8],
+                    m[3]*rhs.m[0] + m[4]*rhs.m[3] + m[5]*rhs.m[6],
+                    m[3]*rhs.m[1] + m[4]*rhs.m[4] + m[5]*rhs.m[7],
+                    m[3]*rhs.m[2] + m[4]*rhs.m[5] + m[5]*rhs.m[8],
+                    m[6]*rhs.m[0] + m[7]*rhs.m[3] + m[8]*rhs.m[6],
+                    m[6]*rhs.m[1] + m[7]*rhs.m[4] + m[8]*rhs.m[7],
+                    m[6]*rhs.m[2] + m[7]*rhs.m[5] + m[8]*rhs.m[8]);
+    }
+
+    Vector operator* (const Vector& v) const {
+        return Vector(m[0]*v.x + m[1]*v.y + m[2]*v.z,
+                      m[3]*v.x + m[4]*v.y + m[5]*v.z,
+                      m[6]*v.x + m[7]*v.y + m[8]*v.z);
+    }
+
+    // v^T * M * u, the quadratic form used by the cone intersection
+    double quadratic ( const Vector &v, const Vector &u ) const {
+        return v.x * (m[0]*u.x + m[1]*u.y + m[2]*u.z)
+             + v.y * (m[3]*u.x + m[4]*u.y + m[5]*u.z)
+             + v.z * (m[6]*u.x + m[7]*u.y + m[8]*u.z);
+    }
+};
+
+struct Mat4 {
+    double m[16];
+
+    // zero matrix, or s on the diagonal
+    constexpr Mat4 ( double s = 0 ) : m{s,0,0,0, 0,s,0,0, 0,0,s,0, 0,0,0,s} {}
+
+    constexpr Mat4 ( double a00, double a01, double a02, double a03,
+                     double a10, double a11, double a12, double a13,
+                     double a20, double a21, double a22, double a23,
+                     double a30, double a31, double a32, double a33 )
+        : m{a00,a01,a02,a03, a10,a11,a12,a13, a20,a21,a22,a23, a30,a31,a32,a33} {}
+
+    constexpr double operator() (int i, int j) const {
+        return m[4 * i + j];
+    }
+
+    double& operator() (int i, int j) {
+        return m[4 * i + j];
+    }
+
+    static constexpr Mat4 identity () {
+        return Mat4(1);
+    }
+
+    constexpr Mat4 transpose () const {
+        return Mat4(m[0], m[4], m[8],  m[12],
+                    m[1], m[5], m[9],  m[13],
+                    m[2], m[6], m[10], m[14],
+                    m[3], m[7], m[11], m[15]);
+    }
+
+    // the upper left 3x3 block, i.e. the linear part of an affine transform
+    constexpr Mat3 linear () const {
+        return Mat3(m[0], m[1], m[2],
+                    m[4], m[5], m[6],
+                    m[8], m[9], m[10]);
+    }
+
+    Mat4 operator* (const Mat4& rhs) const {
+        Mat4 result;
+
+        for (int i = 0; i < 4; ++i)
+            for (int j = 0; j < 4; ++j)
+                result.m[4*i+j] = m[4*i]   * rhs.m[j]   + m[4*i+1] * rhs.m[4+j]
+                                + m[4*i+2] * rhs.m[8+j] + m[4*i+3] * rhs.m[12+j];
+
+        return result;
+    }
+
+    // points get the translation, vectors don't (w = 1 and w = 0)
+    Point operator* (const Point& p) const {
+        return Point(m[0]*p.x + m[1]*p.y + m[2]*p.z  + m[3],
+                     m[4]*p.x + m[5]*p.y + m[6]*p.z  + m[7],
+                     m[8]*p.x + m[9]*p.y + m[10]*p.z + m[11]);
+    }
+
+    Vector operator* (const Vector& v) const {
+        return Vector(m[0]*v.x + m[1]*v.y + m[2]*v.z,
+                      m[4]*v.x + m[5]*v.y + m[6]*v.z,
+                      m[8]*v.x + m[9]*v.y + m[10]*v.z);
     }
 };
 
@@ -312,6 +475,57 @@ struct Voxel
     Voxel(double xLeft, double xRight, double yBottom, double yTop, double zFar, double zNear)
         : xLeft(xLeft), xRight(xRight), yBottom(yBottom), yTop(yTop), zFar(zFar), zNear(zNear) {}
 
+    // degenerate voxel around a single point, grow it with extend
+    Voxel(Point p) : xLeft(p.x), xRight(p.x), yBottom(p.y), yTop(p.y), zFar(p.z), zNear(p.z) {}
+
+    void extend (const Point &p) {
+        xLeft = std::min(xLeft, p.x);
+        xRight = std::max(xRight, p.x);
+        yBottom = std::min(yBottom, p.y);
+        yTop = std::max(yTop, p.y);
+        zFar = std::min(zFar, p.z);
+        zNear = std::max(zNear, p.z);
+    }
+
+    void extend (const Voxel &v) {
+        extend(Point(v.xLeft, v.yBottom, v.zFar));
+        extend(Point(v.xRight, v.yTop, v.zNear));
+    }
+
+    bool contains (const Voxel &v) {
+        return xLeft <= v.xLeft && v.xRight <= xRight &&
+               yBottom <= v.yBottom && v.yTop <= yTop &&
+               zFar <= v.zFar && v.zNear <= zNear;
+    }
+
+    bool operator== (const Voxel &v) {
+        return xLeft == v.xLeft && xRight == v.xRight &&
+               yBottom == v.yBottom && yTop == v.yTop &&
+               zFar == v.zFar && zNear == v.zNear;
+    }
+
+    bool operator!= (const Voxel &v) {
+        return !(*this == v);
+    }
+
+    // same voxel grown by d on every side
+    Voxel grow (double d) {
+        return Voxel(xLeft - d, xRight + d, yBottom - d, yTop + d, zFar - d, zNear + d);
+    }
+
+    bool overlaps (const Voxel &v) {
+        return xLeft <= v.xRight && v.xLeft <= xRight &&
+               yBottom <= v.yTop && v.yBottom <= yTop &&
+               zFar <= v.zNear && v.zFar <= zNear;
+    }
+
+    // the 8 corners, i = 0..7 with one bit per axis
+    Point corner (int i) {
+        return Point((i & 1) ? xRight : xLeft,
+                     (i & 2) ? yTop : yBottom,
+                     (i & 4) ? zNear : zFar);
+    }
+
     Voxel splitFront (int subdiv) {
         if (subdiv == SUBDIV_X)
             return Voxel((xLeft+xRight)/2.0, xRight, yBottom, yTop, zFar, zNear);
@@ -418,6 +632,11 @@ double distance ( const Point &p, const Point &q ) {
     return sqrt(a*a + b*b + c*c);
 }
 
+// perceived luminance of a color, same weights as the tone reproduction
+double luminance ( const Color &c ) {
+    return 0.27 * c.r + 0.67 * c.g + 0.06 * c.b;
+}
+
 double length ( const Vector &v ) {
     return sqrt( v.x*v.x+v.y*v.y+v.z*v.z );
 }
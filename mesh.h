@@ -0,0 +1,210 @@
+#ifndef _MESH_H
+#define _MESH_H
+
+#include <iostream>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include "mathHelper.h"
+#include "object.h"
+#include "lightSource.h"
+#include "kdtree.h"
+
+/*
+ * The Mesh class.
+ *
+ * A list of triangles handled as a single object, with its own kd-tree built
+ * once in the mesh's space. Put it in the world through an Instance to place
+ * the same mesh many times without copying triangles or rebuilding the tree.
+ *
+ * The mesh keeps pointers to its own triangles, so it can't be copied.
+ */
+class Mesh : public Object {
+    std::vector<Triangle> triangles;
+
+    // tree over the triangles
+    Kdtree kd;
+    Voxel bounds;
+
+    // area of the triangles up to and including each one, to sample points
+    std::vector<double> areaSum;
+
+    // The triangle the last intersect on this thread hit (lastHitHint), and
+    // the one the last getNormal or getColor found. Shading asks about the
+    // point the ray just hit, so one of them is nearly always it, without
+    // going through the tree. Indices, so a stale one is still a triangle
+    // we can check.
+    static HitHint& lastFound () {
+        static thread_local HitHint record = { NULL, 0 };
+        return record;
+    }
+
+    bool isOn (const HitHint &record, Point p) {
+        if (record.object != this || record.part >= triangles.size())
+            return false;
+
+        double dist = triangles[record.part].distanceOnSurface(p);
+        return dist >= 0 && dist < 1e-6;
+    }
+
+    // triangleAt, unless the last hit or the last triangle found has p
+    Triangle* triangleFor (Point p) {
+        HitHint &found = lastFound();
+
+        if (isOn(lastHitHint(), p))
+            found = lastHitHint();
+        else if (!isOn(found, p)) {
+            Triangle *t = triangleAt(p);
+            if (t == NULL)
+                return NULL;
+
+            found.object = this;
+            found.part = t - &triangles[0];
+        }
+
+        return &triangles[found.part];
+    }
+
+    // Which triangle is the point p (on the surface of the mesh) on? The leaf
+    // holding p has every triangle that touches it, we pick the closest one.
+    Triangle* triangleAt (Point p) {
+        std::vector<Object*> &candidates = kd.leafObjects(p);
+        Triangle *closest = NULL;
+        double minDist = 0;
+
+        for(std::vector<Object*>::iterator it = candidates.begin() ; it < candidates.end() ; ++it) {
+            Triangle *t = static_cast<Triangle*>(*it);
+            double dist = t->distanceOnSurface(p);
+            if (dist >= 0 && (closest == NULL || dist < minDist)) {
+                closest = t;
+                minDist = dist;
+            }
+        }
+
+        return closest;
+    }
+
+    void buildTree () {
+        std::vector<Object*> objectList;
+
+        bounds = Voxel(triangles[0].getPoints()[0]);
+        areaSum.clear();
+        double area = 0;
+
+        for(std::vector<Triangle>::iterator it = triangles.begin() ; it < triangles.end() ; ++it) {
+            objectList.push_back(&(*it));
+            bounds.extend(it->getBounds());
+
+            area += it->area();
+            areaSum.push_back(area);
+        }
+
+        // a little slack so points on the border still land inside the root
+        kd.build(objectList, bounds.grow(1e-6));
+    }
+
+public:
+    Mesh ( std::vector<Triangle> tris, Color col ) : Object(col), triangles(tris) {
+        if (triangles.empty()) {
+            std::cerr << "Error: When creating a Mesh object, need at least one triangle." << std::endl;
+            exit(1);
+        }
+
+        buildTree();
+    }
+
+    Mesh ( const Mesh& ) = delete;
+    Mesh& operator= ( const Mesh& ) = delete;
+
+    int getNumTriangles () {
+        return triangles.size();
+    }
+
+    Point intersect (Ray ray) {
+        if (!bounds.intersect(ray, 0, std::numeric_limits<double>::max()))
+            return ray.getOrigin();
+
+        Point point;
+        Object *hit = kd.traverse(ray, point);
+
+        if (hit == NULL)
+            return ray.getOrigin();
+
+        HitHint &hint = lastHitHint();
+        hint.object = this;
+        hint.part = static_cast<Triangle*>(hit) - &triangles[0];
+
+        return point;
+    }
+
+    // points spread evenly over the whole surface: each one on a triangle
+    // picked with a chance in proportion to its area
+    std::vector<Point> samplePoints(int numSamples) {
+        std::vector<Point> samples;
+
+        for (int i = 0; i < numSamples; ++i) {
+            double r = static_cast <double> (rand()) / static_cast <double> (RAND_MAX) * areaSum.back();
+            int t = std::upper_bound(areaSum.begin(), areaSum.end(), r) - areaSum.begin();
+            t = std::min(t, int(triangles.size()) - 1);
+
+            std::vector<Point> point = triangles[t].samplePoints(1);
+            samples.push_back(point[0]);
+        }
+
+        return samples;
+    }
+
+    bool isInside (Voxel v) {
+        if (!bounds.overlaps(v))
+            return false;
+
+        for(std::vector<Triangle>::iterator it = triangles.begin() ; it < triangles.end() ; ++it)
+            if (it->isInside(v))
+                return true;
+
+        return false;
+    }
+
+    Vector getNormal (Point p) {
+        Triangle *t = triangleFor(p);
+        return (t == NULL) ? Vector(0,1,0) : t->getNormal(p);
+    }
+
+    // A procedural texture on the whole mesh is a solid one, looked up at
+    // the point without finding the triangle
+    Color getColor (Point p, double footprint) {
+        Material &m = getMaterialRecord();
+        if (m.procedural != NULL)
+            return m.procedural->getColor(p, 0, 0);
+
+        Triangle *t = triangleFor(p);
+        return (t == NULL) ? m.col : t->getColor(p, footprint);
+    }
+
+    // All the vertices, three per triangle. Setting them rebuilds the tree,
+    // to move a mesh around use an Instance instead.
+    void setPoints (std::vector<Point> vertices) {
+        for (unsigned int i = 0; i < triangles.size(); ++i)
+            triangles[i].setPoints(std::vector<Point>(vertices.begin() + 3*i, vertices.begin() + 3*i + 3));
+
+        buildTree();
+    }
+
+    std::vector<Point> getPoints () {
+        std::vector<Point> vertices;
+
+        for(std::vector<Triangle>::iterator it = triangles.begin() ; it < triangles.end() ; ++it) {
+            std::vector<Point> v = it->getPoints();
+            vertices.insert(vertices.end(), v.begin(), v.end());
+        }
+
+        return vertices;
+    }
+
+    Voxel getBounds () {
+        return bounds;
+    }
+};
+
+#endif
@@ -7,38 +7,70 @@
 #include <cstdlib>
 #include "mathHelper.h"
 #include "texture.h"
+#include "proceduralTexture.h"
+#include "material.h"
 
 #include "triBoxOverlap.h"
 
-class Object {
-protected:
-    // material
-    Texture texture;
+class Object;
+
+// What the last intersect on this thread found out about its hit, for
+// objects made of parts (which triangle of a mesh), so shading the point
+// doesn't have to search for the part again. Only a hint: the object checks
+// it is about itself and that the point is on that part. The wavefront
+// renderer keeps one per ray, it shades the hits long after intersecting.
+struct HitHint {
+    const Object *object;
+    unsigned int part;
+};
 
-    // color, also ambient/diffuse for phong
-    Color col;
+HitHint& lastHitHint () {
+    static thread_local HitHint hint = { NULL, 0 };
+    return hint;
+}
 
-    // other phong values
-    Color specular;
-    double ka, kd, ks, ke;
+class Object {
+protected:
+    // index in materialTable(), the material is shared with every object
+    // made of the same one
+    MaterialId material = 0;
 
-    // emmisive 'material' for area lights
-    // if object is emissive, no need for any other color or value
-    bool emissive = false;
-    Color emissiveColor;
+    Material& getMaterialRecord() {
+        return materialTable()[material];
+    }
 
-    // values for reflection and transmission
-    double kr, kt;
+    // the setters change a copy of the material and switch to that one, the
+    // other objects that had the same material keep it as it was
+    template <typename F>
+    void changeMaterial(F change) {
+        Material m = getMaterialRecord();
+        change(m);
 
-    // value for refraction
-    double nr;
+        MaterialId id = materialTable().add(m);
+        materialTable().release(material);
+        material = id;
+    }
 public:
     // Object without solid color, called when creating textured object
     Object() {}
 
-    Object(Color col) : col(col) {}
+    Object(Color col) : material(materialTable().add(Material(col))) {}
 
-    Object(Texture texture) : texture(texture) {}
+    Object(Texture texture) : material(materialTable().add(Material(texture))) {}
+
+    // copies count as users of the material too
+    Object(const Object &other) : material(other.material) {
+        materialTable().acquire(material);
+    }
+
+    Object& operator= (const Object &other) {
+        setMaterial(other.material);
+        return *this;
+    }
+
+    virtual ~Object() {
+        materialTable().release(material);
+    }
 
     virtual Point intersect (Ray ray) = 0;
 
@@ -49,75 +81,129 @@ public:
     virtual Vector getNormal (Point p) = 0;
 
     // this function is to get a color in a specific point, if this object has
-    // a texture
-    virtual Color getColor (Point p) = 0;
+    // a texture. footprint is the world space size of what the pixel covers
+    // around p, for the texture's mip level, 0 for the full size image
+    virtual Color getColor (Point p, double footprint) = 0;
+
+    // getColor of n points at once, e.g. all the hits on this object in a
+    // wavefront batch. A procedural texture does them in one call
+    virtual void getColors (const Point *p, const double *footprint, int n, Color *out) {
+        ProceduralTexture *procedural = getMaterialRecord().procedural;
+
+        if (procedural == NULL) {
+            for (int i = 0; i < n; ++i)
+                out[i] = getColor(p[i], footprint[i]);
+            return;
+        }
+
+        std::vector<double> u(n), v(n);
+        for (int i = 0; i < n; ++i)
+            getUV(p[i], u[i], v[i]);
+
+        procedural->getColors(p, &u[0], &v[0], n, out);
+    }
+
+    // (u,v) of the surface at p for the textures, 0 where the object has none
+    virtual void getUV (Point p, double &u, double &v) {
+        u = 0;
+        v = 0;
+    }
 
     virtual void setPoints (std::vector<Point> vertices) = 0;
 
     virtual std::vector<Point> getPoints () = 0;
 
+    // axis aligned box around the whole object
+    virtual Voxel getBounds () = 0;
+
+    MaterialId getMaterial() {
+        return material;
+    }
+
+    // id from materialTable().add, to give one material to many objects
+    void setMaterial(MaterialId id) {
+        materialTable().acquire(id);
+        materialTable().release(material);
+        material = id;
+    }
+
     Color getColor() {
-        return col;
+        return getMaterialRecord().col;
+    }
+
+    void setUpProceduralTexture(ProceduralTexture *newProcedural) {
+        changeMaterial([&](Material &m) { m.procedural = newProcedural; });
+    }
+
+    // NULL if there is none
+    ProceduralTexture* getProceduralTexture() {
+        return getMaterialRecord().procedural;
     }
 
     void setUpEmissionColor(Color ems) {
-        emissive = true;
-        emissiveColor = ems;
+        changeMaterial([&](Material &m) {
+            m.emissive = true;
+            m.emissiveColor = ems;
+        });
     }
 
     Color getEmissiveColor() {
-        return emissiveColor;
+        return getMaterialRecord().emissiveColor;
     }
 
     bool isEmissive() {
-        return emissive;
+        return getMaterialRecord().emissive;
     }
 
     // kd + ks < 1 YOU PAY ATTENTION JESUS
     void setUpPhong (Color spec, double newka, double newkd, double newks, double newke) {
-        specular = spec;
-        ka = newka;
-        kd = newkd;
-        ks = newks;
-        ke = newke;
+        changeMaterial([&](Material &m) {
+            m.specular = spec;
+            m.ka = newka;
+            m.kd = newkd;
+            m.ks = newks;
+            m.ke = newke;
+        });
     }
 
     void setUpReflectionTransmission(double nkr, double nkt, double nnr) {
-        kr = nkr;
-        kt = nkt;
-        nr = nnr;
+        changeMaterial([&](Material &m) {
+            m.kr = nkr;
+            m.kt = nkt;
+            m.nr = nnr;
+        });
     }
 
     Color getSpecularColor () {
-        return specular;
+        return getMaterialRecord().specular;
     }
 
     double getKa() {
-        return ka;
+        return getMaterialRecord().ka;
     }
 
     double getKd() {
-        return kd;
+        return getMaterialRecord().kd;
     }
 
     double getKs() {
-        return ks;
+        return getMaterialRecord().ks;
     }
 
     double getKe() {
-        return ke;
+        return getMaterialRecord().ke;
     }
 
     double getKr() {
-        return kr;
+        return getMaterialRecord().kr;
     }
 
     double getKt() {
-        return kt;
+        return getMaterialRecord().kt;
     }
 
     double getNr(){
-        return nr;
+        return getMaterialRecord().nr;
     }
 
 };
@@ -223,6 +309,10 @@ public:
         return std::vector<Point>(1,c);
     }
 
+    Voxel getBounds () {
+        return Voxel(c.x - r, c.x + r, c.y - r, c.y + r, c.z - r, c.z + r);
+    }
+
     // returns a number of sample points on the surface of the object
     std::vector<Point> samplePoints(int numSamples) {
         std::vector<Point> samples;
@@ -247,13 +337,30 @@ public:
         return normal;
     }
 
-    Color getColor (Point p) {
-        if (texture.isInitialized())
-            return texture.getColorSphericalMapping(c,r,p);
+    // Same (u,v) as the spherical mapping of the textures
+    void getUV (Point p, double &u, double &v) {
+        Vector local(p.x-c.x,p.y-c.y,p.z-c.z);
+        normalize(local);
+
+        u = 0.5 + atan2(local.x,local.z) / (2.0 * PI);
+        v = 0.5 - asin(local.y) / PI;
+    }
+
+    Color getColor (Point p, double footprint) {
+        Material &m = getMaterialRecord();
+
+        if (m.procedural != NULL) {
+            double u, v;
+            getUV(p, u, v);
+            return m.procedural->getColor(p, u, v);
+        }
+
+        if (m.texture.isInitialized())
+            return m.texture.getColorSphericalMapping(c,r,p,footprint);
         else if (*colorFromTexture != NULL)
             return (*colorFromTexture)(c,r,p);
         else
-            return col;
+            return m.col;
     }
 };
 
@@ -369,13 +476,37 @@ public:
         return Point(wx,wy,wz);
     }
 
-    // returns a number of sample points on the surface of the object
-    // TODO
+    // returns a number of sample points on the surface of the object,
+    // spread evenly over it
     std::vector<Point> samplePoints(int numSamples) {
         std::vector<Point> samples;
+
+        for (int i = 0; i < numSamples; ++i) {
+            double r1 = static_cast <double> (rand()) / static_cast <double> (RAND_MAX);
+            double r2 = static_cast <double> (rand()) / static_cast <double> (RAND_MAX);
+            samples.push_back( pointAt(r1, r2) );
+        }
+
         return samples;
     }
 
+    // Point of the triangle for two numbers in [0,1], random ones give
+    // points evenly spread over it
+    Point pointAt (double r1, double r2) {
+        double s = std::sqrt(r1);
+        double a = 1.0 - s;
+        double b = s * (1.0 - r2);
+        double c = s * r2;
+
+        return Point(a * vertices[0].x + b * vertices[1].x + c * vertices[2].x,
+                     a * vertices[0].y + b * vertices[1].y + c * vertices[2].y,
+                     a * vertices[0].z + b * vertices[1].z + c * vertices[2].z);
+    }
+
+    double area () {
+        return 0.5 * length( cross( Vector(vertices[0],vertices[1]), Vector(vertices[0],vertices[2]) ) );
+    }
+
     void setPoints (std::vector<Point> vert) {
         vertices = vert;
         normal = cross( Vector(vert[0],vert[1],true), Vector(vert[0],vert[2],true));
@@ -385,6 +516,36 @@ public:
         return vertices;
     }
 
+    Voxel getBounds () {
+        Voxel bounds(vertices[0]);
+        bounds.extend(vertices[1]);
+        bounds.extend(vertices[2]);
+        return bounds;
+    }
+
+    // Distance from p to the plane of the triangle, if p projects inside the
+    // triangle (with a small tolerance), otherwise -1. Used to find which
+    // triangle of a mesh a hit point belongs to.
+    double distanceOnSurface (Point p) {
+        Vector edge1(vertices[0],vertices[1]);
+        Vector edge2(vertices[0],vertices[2]);
+        Vector n = cross(edge1, edge2);
+        double nn = dot(n, n);
+
+        if (nn == 0.0)
+            return -1;
+
+        Vector w(vertices[0], p);
+        double u = dot(cross(w, edge2), n) / nn;
+        double v = dot(cross(edge1, w), n) / nn;
+        double eps = 1e-6;
+
+        if (u < -eps || v < -eps || u + v > 1.0 + eps)
+            return -1;
+
+        return std::abs(dot(w, n)) / std::sqrt(nn);
+    }
+
     // checks if this object is inside a voxel
     // returns true if even part of the object is inside of it
     bool isInside (Voxel v) {
@@ -407,9 +568,32 @@ public:
         return normal;
     }
 
-    Color getColor (Point p) {
+    // Barycentric coordinates of p, the weights of the second and the third
+    // vertex
+    void getUV (Point p, double &u, double &v) {
+        Vector e1(vertices[0], vertices[1]);
+        Vector e2(vertices[0], vertices[2]);
+        Vector w(vertices[0], p);
+
+        double d11 = dot(e1, e1), d12 = dot(e1, e2), d22 = dot(e2, e2);
+        double w1 = dot(w, e1), w2 = dot(w, e2);
+        double det = d11 * d22 - d12 * d12;
+
+        u = (d22 * w1 - d12 * w2) / det;
+        v = (d11 * w2 - d12 * w1) / det;
+    }
+
+    Color getColor (Point p, double footprint) {
+        Material &m = getMaterialRecord();
+
+        if (m.procedural != NULL) {
+            double u, v;
+            getUV(p, u, v);
+            return m.procedural->getColor(p, u, v);
+        }
+
         if (*colorFromTexture == NULL)
-            return col;
+            return m.col;
         else
             return (*colorFromTexture)(vertices,p);
     }
@@ -426,13 +610,22 @@ class Rectangle : public Object {
     // normal, calculated based on vertices
     Vector n;
 
-    // values for plane description
-    double a,b,c,dist;
+    // the plane is every p with dot(n, p) == planeD
+    double planeD;
+
+    // Set up with the plane, so intersections don't need to build any vector.
+    // The rectangle is p1 + u * (p2 - p1) + v * (p4 - p1) for u,v in [0,1],
+    // dot(p - p1, dualU) gives u and dot(p - p1, dualV) gives v. This holds
+    // for any parallelogram, not just rectangles.
+    Vector dualU, dualV;
 
     // this is a function pointer for a possible texture function,
     // it requires a vector of points (the vertices of the polygon) and a point
     // in the polygon as parameters, and returns the color of that point
     Color (*colorFromTexture)(Point, Point, Point, Point, Point); // = NULL;
+
+    // texture function on the (u,v) of the point instead
+    Color (*colorFromUV)(double, double); // = NULL;
 public:
 
     // creating an object
@@ -453,6 +646,7 @@ public:
         canculatePlaneAndNormal();
 
         colorFromTexture = NULL;
+        colorFromUV = NULL;
     }
 
     // creating an object
@@ -473,38 +667,71 @@ public:
         canculatePlaneAndNormal();
 
         colorFromTexture = function;
+        colorFromUV = NULL;
+    }
+
+    // textured with a function of the (u,v) coordinates, (0,0) at p1, u goes
+    // towards p2 and v towards p4
+    Rectangle ( std::vector<Point> vert, Color (*function)(double, double) ) {
+
+        if (vert.size() != 4) {
+            std::cerr << "Error: When creating a Rectangle object, need exactly 4 vertices, but " << vert.size() << " were used." << std::endl;
+            exit(1);
+        }
+
+        p1 = vert[0];
+        p2 = vert[1];
+        p3 = vert[2];
+        p4 = vert[3];
+
+        canculatePlaneAndNormal();
+
+        colorFromTexture = NULL;
+        colorFromUV = function;
+    }
+
+    // image texture stretched over the whole rectangle, same (u,v) as above
+    Rectangle ( std::vector<Point> vert, Texture texture ) : Object(texture) {
+
+        if (vert.size() != 4) {
+            std::cerr << "Error: When creating a Rectangle object, need exactly 4 vertices, but " << vert.size() << " were used." << std::endl;
+            exit(1);
+        }
+
+        p1 = vert[0];
+        p2 = vert[1];
+        p3 = vert[2];
+        p4 = vert[3];
+
+        canculatePlaneAndNormal();
+
+        colorFromTexture = NULL;
+        colorFromUV = NULL;
     }
 
     // Rectangle-ray intersection. First check intersection with plane, if it
-    // happened then check intersection between the four points of the
-    // recangle through dot products
+    // happened then check the (u,v) of the point is inside the rectangle
     Point intersect (Ray ray) {
+        double u, v;
+        return intersectUV(ray, u, v);
+    }
+
+    // same, also giving the (u,v) of the intersection for texturing
+    Point intersectUV (Ray ray, double &u, double &v) {
         Point o = ray.getOrigin();
         Vector d = ray.getDirection();
         normalize(d);
 
-        double t = -(a*o.x + b*o.y + c*o.z + dist) / (a*d.x + b*d.y + c*d.z);
+        double t = (planeD - (n.x*o.x + n.y*o.y + n.z*o.z)) / (n.x*d.x + n.y*d.y + n.z*d.z);
 
         // there was a intersection, let's check if it is between the rectangle boundaries
         if ( t > 0.0 ) {
             // actual intersection point
-            double tx = o.x + d.x * t;
-            double ty = o.y + d.y * t;
-            double tz = o.z + d.z * t;
-            Point intersectionPoint(tx, ty, tz);
-
-            Vector v1(p1,p2,true);
-            Vector v3(p3,p4,true);
-            Vector v4(p1,intersectionPoint,true);
-            Vector v5(p3,intersectionPoint,true);
-
-            Vector v1_a(p2,p3,true);
-            Vector v3_a(p4,p1,true);
-            Vector v4_a(p2,intersectionPoint,true);
-            Vector v5_a(p4,intersectionPoint,true);
-
-            if (dot(v1,v4) >= 0.0 && dot(v3,v5) >= 0.0
-                && dot(v1_a,v4_a) >= 0.0 && dot(v3_a,v5_a) >= 0.0 ) {
+            Point intersectionPoint(o.x + d.x * t, o.y + d.y * t, o.z + d.z * t);
+
+            getUV(intersectionPoint, u, v);
+
+            if (u >= 0.0 && u <= 1.0 && v >= 0.0 && v <= 1.0) {
                 return intersectionPoint;
             }
         }
@@ -512,6 +739,16 @@ public:
         return o;
     }
 
+    // (u,v) of a point on the rectangle's plane
+    void getUV (Point p, double &u, double &v) {
+        double wx = p.x - p1.x;
+        double wy = p.y - p1.y;
+        double wz = p.z - p1.z;
+
+        u = wx*dualU.x + wy*dualU.y + wz*dualU.z;
+        v = wx*dualV.x + wy*dualV.y + wz*dualV.z;
+    }
+
     // Returns a number of sample points on the surface of the object
     std::vector<Point> samplePoints(int numSamples) {
         std::vector<Point> samples;
@@ -563,6 +800,14 @@ public:
         return vertices;
     }
 
+    Voxel getBounds () {
+        Voxel bounds(p1);
+        bounds.extend(p2);
+        bounds.extend(p3);
+        bounds.extend(p4);
+        return bounds;
+    }
+
     // checks if this object is inside a voxel
     // returns true if even part of the object is inside of it
     bool isInside (Voxel v) {
@@ -578,21 +823,44 @@ public:
         return n;
     }
 
-    Color getColor (Point p) {
+    Color getColor (Point p, double footprint) {
+        Material &m = getMaterialRecord();
+
+        if (m.procedural != NULL || colorFromUV != NULL || m.texture.isInitialized()) {
+            double u, v;
+            getUV(p, u, v);
+
+            if (m.procedural != NULL)
+                return m.procedural->getColor(p, u, v);
+
+            if (colorFromUV != NULL)
+                return (*colorFromUV)(u, v);
+            // one texture width is 1 / |dualU| across the rectangle
+            return m.texture.getColorUV(u, v, footprint * length(dualU));
+        }
+
         if (*colorFromTexture == NULL)
-            return col;
+            return m.col;
         else
             return (*colorFromTexture)(p1,p2,p3,p4,p);
     }
 
     void canculatePlaneAndNormal() {
-        a = p1.y*(p2.z-p3.z) + p2.y*(p3.z-p1.z) + p3.y*(p1.z-p2.z);
-        b = p1.z*(p2.x-p3.x) + p2.z*(p3.x-p1.x) + p3.z*(p1.x-p2.x);
-        c = p1.x*(p2.y-p3.y) + p2.x*(p3.y-p1.y) + p3.x*(p1.y-p2.y);
-        dist = -p1.x*(p2.y*p3.z-p3.y*p2.z) - p2.x*(p3.y*p1.z - p1.y*p3.z) - p3.x*(p1.y*p2.z - p2.y*p1.z);
-
         n = cross( Vector(p1,p4) , Vector(p1,p2) );
         normalize(n);
+
+        planeD = n.x*p1.x + n.y*p1.y + n.z*p1.z;
+
+        Vector edgeU(p1,p2);
+        Vector edgeV(p1,p4);
+
+        double uu = dot(edgeU, edgeU);
+        double vv = dot(edgeV, edgeV);
+        double uv = dot(edgeU, edgeV);
+        double det = uu * vv - uv * uv;
+
+        dualU = (vv * edgeU - uv * edgeV) / det;
+        dualV = (uu * edgeV - uv * edgeU) / det;
     }
 };
 
@@ -3,8 +3,47 @@
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
 #include "mathHelper.h"
 
+// Patterns are plain arithmetic on the point (a floor and a few multiplies,
+// no loops over cells, no tables and no branches), so they cost the same
+// anywhere and the batch versions vectorize.
+
+// floor(x) as an int, for x in the int range. std::floor is a library call
+// the vectorizer won't touch (without -fno-trapping-math), this is a
+// truncation and a compare
+inline int floorInt (double x) {
+    int t = int(x);
+    return t - (double(t) > x);
+}
+
+// 0 or 1, which color of a checkerboard of 'size' squares (u,v) is in
+inline int checkerParity (double u, double v, double size) {
+    return (floorInt(u / size) + floorInt(v / size)) & 1;
+}
+
+// Pseudo random bits for each point of the integer lattice
+inline uint32_t latticeHash (int x, int y, int z) {
+    uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+
+    return h;
+}
+
+// Pseudo random value in [0,1) for each point of the integer lattice
+inline double latticeValue (int x, int y, int z) {
+    return (latticeHash(x, y, z) & 0xffffff) / double(0x1000000);
+}
+
+// Soft stripes across x, 'width' apart, in [0,1]
+inline double stripes (double x, double width) {
+    return 0.5 + 0.5 * std::sin(PI * x / width);
+}
+
 // let's assume for now this will always be used for a floor that always coincides
 // with the x and z plane (y is constant)
 //
@@ -16,41 +55,226 @@
 //
 // looking down on y
 Color planarCheckerTexture (Point p1, Point p2, Point p3, Point p4, Point p) {
-    Color finalColor;
-
-    int row, col;
     double checksize = 0.05;
 
-    // need to normalize point between -1 and 1
-    double zn = (2 * (p.z - p2.z) / (p1.z - p2.z)) - 1;
-    double xn = (2 * (p.x - p2.x) / (p3.x - p2.x)) - 1;
+    // position between 0 and 1 along each side
+    double u = (p.z - p2.z) / (p1.z - p2.z);
+    double v = (p.x - p2.x) / (p3.x - p2.x);
+
+    if (checkerParity(u, v, checksize))
+        return Color(1,1,0);
+
+    return Color(1,0,0);
+}
+
+// Batch versions, for n samples given as separate arrays of coordinates so
+// the loops vectorize. out[i] is the pattern at sample i.
+
+void checkerParityBatch (const double *u, const double *v, int n, double size, double *out) {
+    double inv = 1.0 / size;
+    for (int i = 0; i < n; ++i)
+        out[i] = (floorInt(u[i] * inv) + floorInt(v[i] * inv)) & 1;
+}
+
+// Gradient (Perlin) noise in about [-1,1], 0 on every lattice point. Each
+// lattice point gets one of 16 directions (the 12 cube edges, 4 of them
+// twice) from 4 bits of latticeHash. The direction is picked with selects
+// on those bits, as in Perlin's improved noise, instead of a table lookup
+// the vectorizer would have to gather from
+inline double gradientDot (int x, int y, int z, double dx, double dy, double dz) {
+    uint32_t h = (latticeHash(x, y, z) >> 20) & 15;
+
+    double a = (h < 8) ? dx : dy;
+    double b = (h < 4) ? dy : ((h == 12 || h == 14) ? dx : dz);
+
+    return ((h & 1) ? -a : a) + ((h & 2) ? -b : b);
+}
+
+inline double gradientNoise (double x, double y, double z) {
+    int ix = floorInt(x), iy = floorInt(y), iz = floorInt(z);
+    double fx = ix, fy = iy, fz = iz;
+
+    double dx = x - fx, dy = y - fy, dz = z - fz;
+
+    // quintic fade, smooth up to the second derivative
+    double tx = dx * dx * dx * (dx * (dx * 6 - 15) + 10);
+    double ty = dy * dy * dy * (dy * (dy * 6 - 15) + 10);
+    double tz = dz * dz * dz * (dz * (dz * 6 - 15) + 10);
+
+    double c000 = gradientDot(ix,   iy,   iz,   dx,   dy,   dz  );
+    double c100 = gradientDot(ix+1, iy,   iz,   dx-1, dy,   dz  );
+    double c010 = gradientDot(ix,   iy+1, iz,   dx,   dy-1, dz  );
+    double c110 = gradientDot(ix+1, iy+1, iz,   dx-1, dy-1, dz  );
+    double c001 = gradientDot(ix,   iy,   iz+1, dx,   dy,   dz-1);
+    double c101 = gradientDot(ix+1, iy,   iz+1, dx-1, dy,   dz-1);
+    double c011 = gradientDot(ix,   iy+1, iz+1, dx,   dy-1, dz-1);
+    double c111 = gradientDot(ix+1, iy+1, iz+1, dx-1, dy-1, dz-1);
+
+    double c00 = c000 + tx * (c100 - c000);
+    double c10 = c010 + tx * (c110 - c010);
+    double c01 = c001 + tx * (c101 - c001);
+    double c11 = c011 + tx * (c111 - c011);
+
+    double c0 = c00 + ty * (c10 - c00);
+    double c1 = c01 + ty * (c11 - c01);
+
+    return c0 + tz * (c1 - c0);
+}
+
+// Fractal (fBm) noise: 'octaves' layers of gradient noise, each one
+// 'lacunarity' times finer and 'gain' times weaker than the last
+inline double fbm (double x, double y, double z, int octaves, double lacunarity = 2.0, double gain = 0.5) {
+    double sum = 0;
+    double frequency = 1, amplitude = 1;
+
+    for (int i = 0; i < octaves; ++i) {
+        sum += amplitude * gradientNoise(x * frequency, y * frequency, z * frequency);
+        frequency *= lacunarity;
+        amplitude *= gain;
+    }
+
+    return sum;
+}
+
+// the octaves outside, so the loop over the samples is the inner one
+void fbmBatch (const double *x, const double *y, const double *z, int n, int octaves, double *out,
+               double lacunarity = 2.0, double gain = 0.5) {
+    for (int i = 0; i < n; ++i)
+        out[i] = 0;
+
+    double frequency = 1, amplitude = 1;
+
+    for (int o = 0; o < octaves; ++o) {
+        for (int i = 0; i < n; ++i)
+            out[i] += amplitude * gradientNoise(x[i] * frequency, y[i] * frequency, z[i] * frequency);
+
+        frequency *= lacunarity;
+        amplitude *= gain;
+    }
+}
+
+/*
+ * The ProceduralTexture class.
+ *
+ * Color of a surface from where it was hit: the point (in the object's own
+ * space for meshes behind an Instance) and the (u,v) of the surface there.
+ * Every object takes one through setUpProceduralTexture, whatever its
+ * shape, and it needs no image memory however big the object is.
+ *
+ * getColors does n hits at once (the wavefront renderer gives it all the
+ * hits on an object), the textures below evaluate those with the batch
+ * functions above.
+ */
+class ProceduralTexture {
+public:
+    virtual ~ProceduralTexture () {}
+
+    virtual Color getColor (const Point &p, double u, double v) = 0;
+
+    virtual void getColors (const Point *p, const double *u, const double *v, int n, Color *out) {
+        for (int i = 0; i < n; ++i)
+            out[i] = getColor(p[i], u[i], v[i]);
+    }
+};
+
+// checkerboard over (u,v), 'size' squares
+class CheckerTexture : public ProceduralTexture {
+    double size;
+    Color even, odd;
+
+public:
+    CheckerTexture (double size, Color even, Color odd) : size(size), even(even), odd(odd) {}
+
+    Color getColor (const Point &p, double u, double v) {
+        return checkerParity(u, v, size) ? odd : even;
+    }
+
+    void getColors (const Point *p, const double *u, const double *v, int n, Color *out) {
+        std::vector<double> parity(n);
+        checkerParityBatch(u, v, n, size, &parity[0]);
+
+        for (int i = 0; i < n; ++i)
+            out[i] = parity[i] ? odd : even;
+    }
+};
 
-    double u = (zn + 1.0) / 2.0;
-    double v = (xn + 1.0) / 2.0;
+// soft stripes across x, 'width' apart
+class StripesTexture : public ProceduralTexture {
+    Color low, high;
+    double width;
 
-    // find row and col
-    for (int i = 0; i < (1/checksize); ++i){
-        if (i*checksize < v && v < (i+1)*checksize) {
-            row = i;
+public:
+    StripesTexture (Color low, Color high, double width) : low(low), high(high), width(width) {}
+
+    Color getColor (const Point &p, double u, double v) {
+        double t = stripes(p.x, width);
+        return (1 - t) * low + t * high;
+    }
+};
+
+// fBm noise in space, from 'low' to 'high', 'scale' lattice cells per unit
+class NoiseTexture : public ProceduralTexture {
+    Color low, high;
+    double scale;
+    int octaves;
+
+public:
+    NoiseTexture (Color low, Color high, double scale, int octaves = 5) : low(low), high(high), scale(scale), octaves(octaves) {}
+
+    Color getColor (const Point &p, double u, double v) {
+        double t = std::min(std::max(0.5 + 0.5 * fbm(p.x * scale, p.y * scale, p.z * scale, octaves), 0.0), 1.0);
+        return (1 - t) * low + t * high;
+    }
+
+    void getColors (const Point *p, const double *u, const double *v, int n, Color *out) {
+        std::vector<double> x(n), y(n), z(n), t(n);
+        for (int i = 0; i < n; ++i) {
+            x[i] = p[i].x * scale;
+            y[i] = p[i].y * scale;
+            z[i] = p[i].z * scale;
         }
-        if (i*checksize < u && u < (i+1)*checksize) {
-            col = i;
+
+        fbmBatch(&x[0], &y[0], &z[0], n, octaves, &t[0]);
+
+        for (int i = 0; i < n; ++i) {
+            double s = std::min(std::max(0.5 + 0.5 * t[i], 0.0), 1.0);
+            out[i] = (1 - s) * low + s * high;
         }
     }
+};
 
-    // check even or odds to know the color
-    if (row % 2 && col % 2) {
-        finalColor = Color(1,0,0);
-    } else if (row % 2 && !(col % 2)) {
-        finalColor = Color(1,1,0);
-    } else if (!(row % 2) && col % 2) {
-        finalColor = Color(1,1,0);
-    } else {
-        finalColor = Color(1,0,0);
+// veins along x, bent by fBm noise
+class MarbleTexture : public ProceduralTexture {
+    Color base, vein;
+    double scale;
+
+    // x and the noise there, both in lattice cells
+    Color color (double x, double noise) {
+        double t = stripes(x + 3 * noise, 1.0);
+        t = t * t * t;
+        return (1 - t) * base + t * vein;
     }
 
-    return finalColor;
-}
+public:
+    MarbleTexture (Color base, Color vein, double scale) : base(base), vein(vein), scale(scale) {}
+
+    Color getColor (const Point &p, double u, double v) {
+        return color(p.x * scale, fbm(p.x * scale, p.y * scale, p.z * scale, 5));
+    }
 
+    void getColors (const Point *p, const double *u, const double *v, int n, Color *out) {
+        std::vector<double> x(n), y(n), z(n), noise(n);
+        for (int i = 0; i < n; ++i) {
+            x[i] = p[i].x * scale;
+            y[i] = p[i].y * scale;
+            z[i] = p[i].z * scale;
+        }
+
+        fbmBatch(&x[0], &y[0], &z[0], n, 5, &noise[0]);
+
+        for (int i = 0; i < n; ++i)
+            out[i] = color(x[i], noise[i]);
+    }
+};
 
 #endif
@@ -2,19 +2,382 @@
 #define _TEXTUREOLD_H
 
 #include <vector>
+#include <map>
+#include <list>
+#include <string>
+#include <fstream>
+#include <iostream>
 #include <cmath>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
 #include "mathHelper.h"
+#include "half.h"
 
 #include <SFML/Graphics.hpp>
 #include <SFML/Graphics/Image.hpp>
 
+// how the texels of the smaller mip levels are kept, 3 bytes or 3 halfs
+// each. Level 0 is always the file as it was decoded, 8 bit
+#define TEXTURE_8BIT 0
+#define TEXTURE_HALF 1
+
+// texels on each side of a cached tile
+#define TEXTURE_TILE 64
+
+// default memory cap of the texture cache, decoded files and tiles together.
+// A file that doesn't fit next to the tiles it needs is dropped and decoded
+// again, so keep it well above the largest file
+#define TEXTURE_CACHE_BYTES (256 << 20)
+
+// A square (smaller on the right and bottom edges) of one mip level, or a
+// whole decoded file. Row after row, rgb next to each other, only the vector
+// for the format is used
+struct textureTile {
+    int width;
+    std::vector<unsigned char> rgb8;
+    std::vector<Half> rgbHalf;
+
+    size_t bytes() const {
+        return sizeof(textureTile) + rgb8.size() + rgbHalf.size() * sizeof(Half);
+    }
+};
+
+/*
+ * The TextureCache class.
+ *
+ * Every texture of the program, keyed by file name and format, so objects
+ * using the same file share the texels. Opening a file doesn't read it: it is
+ * decoded on the first lookup. The decoded file is level 0, one big tile,
+ * and each tile of the smaller mip levels is made from it the first time a
+ * lookup needs it. Decoded files and tiles are dropped, least recently used
+ * first, when together they take more than the memory cap, and made again
+ * if needed later.
+ *
+ * Use textureCache() to get the one shared by the whole program. Thread safe.
+ */
+class TextureCache {
+public:
+    // one file in one format. The size is only known once it is loaded
+    struct image {
+        std::string filename;
+        int format;
+        int id;
+
+        std::once_flag loading;
+        int width, height;
+        std::vector<int> levelWidth, levelHeight;
+
+        // one thread decodes the file again after it was dropped, the
+        // others wait for it
+        std::mutex decoding;
+
+        image (std::string filename, int format, int id) : filename(filename), format(format), id(id), width(0), height(0) {}
+    };
+
+private:
+    struct item {
+        std::shared_ptr<const textureTile> tile;
+        std::list<uint64_t>::iterator use;
+    };
+
+    std::mutex mutex;
+    std::map<std::pair<std::string, int>, std::shared_ptr<image> > images;
+    int nextId = 0;
+
+    // tiles and decoded files, the most recently used first in 'uses'
+    std::map<uint64_t, item> items;
+    std::list<uint64_t> uses;
+
+    size_t memoryUsed = 0;
+    size_t memoryLimit = TEXTURE_CACHE_BYTES;
+
+    static uint64_t key (int id, int level, int tx, int ty) {
+        return (uint64_t(id) << 40) | (uint64_t(level) << 32) | (uint64_t(ty) << 16) | uint64_t(tx);
+    }
+
+    std::shared_ptr<const textureTile> find (uint64_t k) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        std::map<uint64_t, item>::iterator it = items.find(k);
+        if (it == items.end())
+            return std::shared_ptr<const textureTile>();
+
+        uses.splice(uses.begin(), uses, it->second.use);
+        return it->second.tile;
+    }
+
+    // keeps the one already there if another thread made it first
+    std::shared_ptr<const textureTile> insert (uint64_t k, std::shared_ptr<const textureTile> tile) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        std::map<uint64_t, item>::iterator it = items.find(k);
+        if (it != items.end())
+            return it->second.tile;
+
+        uses.push_front(k);
+        item i;
+        i.tile = tile;
+        i.use = uses.begin();
+        items[k] = i;
+        memoryUsed += tile->bytes();
+
+        // tiles still being read by a lookup stay alive until it is done
+        while (memoryUsed > memoryLimit && uses.size() > 1) {
+            std::map<uint64_t, item>::iterator last = items.find(uses.back());
+            memoryUsed -= last->second.tile->bytes();
+            items.erase(last);
+            uses.pop_back();
+        }
+
+        return tile;
+    }
+
+    // the file as 8 bit rgb
+    std::shared_ptr<const textureTile> decode (image &img) {
+        sf::Image file;
+        if (!file.loadFromFile(img.filename)) {
+            std::cerr << "Error: When loading file '" << img.filename << std::endl;
+            exit(1);
+        }
+
+        sf::Vector2u size = file.getSize();
+
+        std::shared_ptr<textureTile> decoded = std::make_shared<textureTile>();
+        decoded->width = size.x;
+        decoded->rgb8.reserve(3 * size.x * size.y);
+
+        for (unsigned int j = 0; j < size.y; ++j) {
+            for (unsigned int i = 0; i < size.x; ++i) {
+                sf::Color c = file.getPixel(i,j);
+                decoded->rgb8.push_back(c.r);
+                decoded->rgb8.push_back(c.g);
+                decoded->rgb8.push_back(c.b);
+            }
+        }
+
+        return decoded;
+    }
+
+    // The size is only known once the file is decoded, so that happens here
+    // too; the decoded file goes in the cache as level 0
+    void load (image &img) {
+        std::shared_ptr<const textureTile> source = decode(img);
+
+        img.width = source->width;
+        img.height = source->rgb8.size() / (3 * source->width);
+
+        bool tooBig;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            tooBig = source->bytes() > memoryLimit;
+        }
+
+        if (tooBig)
+            std::cerr << "Warning: texture '" << img.filename << "' takes more than the texture cache limit, it will be decoded again whenever it is needed." << std::endl;
+
+        insert(key(img.id, 0, 0, 0), source);
+
+        // level 0 is the image, each next one half the size down to 1x1
+        int w = img.width, h = img.height;
+        while (true) {
+            img.levelWidth.push_back(w);
+            img.levelHeight.push_back(h);
+
+            if (w == 1 && h == 1)
+                break;
+
+            w = std::max(w / 2, 1);
+            h = std::max(h / 2, 1);
+        }
+    }
+
+    // the decoded file, decoded again if it was dropped
+    std::shared_ptr<const textureTile> getSource (image &img) {
+        uint64_t k = key(img.id, 0, 0, 0);
+
+        std::shared_ptr<const textureTile> source = find(k);
+        if (source)
+            return source;
+
+        std::unique_lock<std::mutex> lock(img.decoding);
+
+        source = find(k);
+        if (source)
+            return source;
+
+        return insert(k, decode(img));
+    }
+
+    // Tile (tx,ty) of a mip level past 0, each texel the average of the
+    // 2^level by 2^level block of the file under it
+    std::shared_ptr<const textureTile> makeTile (image &img, int level, int tx, int ty) {
+        std::shared_ptr<const textureTile> source = getSource(img);
+
+        int x0 = tx * TEXTURE_TILE;
+        int y0 = ty * TEXTURE_TILE;
+        int w = std::min(TEXTURE_TILE, img.levelWidth[level] - x0);
+        int h = std::min(TEXTURE_TILE, img.levelHeight[level] - y0);
+
+        std::shared_ptr<textureTile> tile = std::make_shared<textureTile>();
+        tile->width = w;
+
+        int block = 1 << level;
+
+        for (int y = y0; y < y0 + h; ++y) {
+            int ya = std::min(y * block, img.height - 1);
+            int yb = std::min(ya + block, img.height);
+
+            for (int x = x0; x < x0 + w; ++x) {
+                int xa = std::min(x * block, img.width - 1);
+                int xb = std::min(xa + block, img.width);
+
+                double sum[3] = { 0, 0, 0 };
+                for (int sy = ya; sy < yb; ++sy) {
+                    const unsigned char *p = &source->rgb8[3 * (sy * img.width + xa)];
+                    for (int sx = xa; sx < xb; ++sx, p += 3) {
+                        sum[0] += p[0];
+                        sum[1] += p[1];
+                        sum[2] += p[2];
+                    }
+                }
+
+                double n = double(xb - xa) * (yb - ya);
+                for (int c = 0; c < 3; ++c) {
+                    if (img.format == TEXTURE_HALF)
+                        tile->rgbHalf.push_back( Half(float(sum[c] / n / 255.0)) );
+                    else
+                        tile->rgb8.push_back( (unsigned char)(sum[c] / n + 0.5) );
+                }
+            }
+        }
+
+        return insert(key(img.id, level, tx, ty), tile);
+    }
+
+public:
+    // The image for a file, without reading it yet. Only checks that the
+    // file is there, so a wrong name is still caught while setting up the
+    // scene
+    std::shared_ptr<image> open (std::string filename, int format) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        std::pair<std::string, int> name(filename, format);
+        std::map<std::pair<std::string, int>, std::shared_ptr<image> >::iterator it = images.find(name);
+        if (it != images.end())
+            return it->second;
+
+        if (!std::ifstream(filename.c_str()).good()) {
+            std::cerr << "Error: When loading file '" << filename << std::endl;
+            exit(1);
+        }
+
+        std::shared_ptr<image> img = std::make_shared<image>(filename, format, nextId++);
+        images[name] = img;
+        return img;
+    }
+
+    // reads the file the first time, the size is set after this
+    void ensureLoaded (image &img) {
+        std::call_once(img.loading, [&] () { load(img); });
+    }
+
+    // tile (tx,ty) of a mip level. Level 0 has a single tile, (0,0), the
+    // whole decoded file
+    std::shared_ptr<const textureTile> getTile (image &img, int level, int tx, int ty) {
+        if (level == 0)
+            return getSource(img);
+
+        std::shared_ptr<const textureTile> tile = find(key(img.id, level, tx, ty));
+        if (tile)
+            return tile;
+
+        return makeTile(img, level, tx, ty);
+    }
+
+    // only checked as things are added, nothing is dropped right away
+    void setMemoryLimit (size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        memoryLimit = bytes;
+    }
+
+    size_t getMemoryUsed () {
+        std::unique_lock<std::mutex> lock(mutex);
+        return memoryUsed;
+    }
+};
+
+TextureCache& textureCache () {
+    static TextureCache cache;
+    return cache;
+}
+
 class Texture {
     // sentinel value to see if texture was setup
     bool initialized;
 
-    int height, width;
+    // in the cache, shared by every copy of this texture and every other
+    // texture of the same file
+    std::shared_ptr<TextureCache::image> image;
+
+    Color texel(int level, int x, int y) {
+        // the tile of the last texel this thread looked up, most lookups
+        // land on the same one and don't need the cache's lock
+        static thread_local int lastId = -1, lastLevel, lastX, lastY;
+        static thread_local std::shared_ptr<const textureTile> lastTile;
+
+        // level 0 is one tile, the decoded file
+        int tx = (level == 0) ? 0 : x / TEXTURE_TILE;
+        int ty = (level == 0) ? 0 : y / TEXTURE_TILE;
+
+        if (lastId != image->id || lastLevel != level || lastX != tx || lastY != ty) {
+            lastTile = textureCache().getTile(*image, level, tx, ty);
+            lastId = image->id;
+            lastLevel = level;
+            lastX = tx;
+            lastY = ty;
+        }
+
+        int i = 3 * ((y - ty * TEXTURE_TILE) * lastTile->width + (x - tx * TEXTURE_TILE));
+
+        if (level > 0 && image->format == TEXTURE_HALF)
+            return Color(float(lastTile->rgbHalf[i]), float(lastTile->rgbHalf[i+1]), float(lastTile->rgbHalf[i+2]));
+
+        return Color(lastTile->rgb8[i] / 255.0, lastTile->rgb8[i+1] / 255.0, lastTile->rgb8[i+2] / 255.0);
+    }
+
+    // bilinear lookup on one level, u wraps around if wrapU (spheres),
+    // otherwise both clamp to the border
+    Color bilinear(int l, double u, double v, bool wrapU) {
+        int width = image->levelWidth[l];
+        int height = image->levelHeight[l];
+
+        double x = u * width - 0.5;
+        double y = std::min(std::max(v, 0.0), 1.0) * height - 0.5;
+
+        int x0 = (int)std::floor(x);
+        int y0 = (int)std::floor(y);
+        double fx = x - x0;
+        double fy = y - y0;
+
+        int x1 = x0 + 1;
+        int y1 = std::min(y0 + 1, height - 1);
+        y0 = std::max(y0, 0);
+
+        if (wrapU) {
+            x0 = ((x0 % width) + width) % width;
+            x1 = ((x1 % width) + width) % width;
+        } else {
+            x0 = std::min(std::max(x0, 0), width - 1);
+            x1 = std::min(std::max(x1, 0), width - 1);
+        }
+
+        Color top = (1 - fx) * texel(l, x0, y0) + fx * texel(l, x1, y0);
+        Color bottom = (1 - fx) * texel(l, x0, y1) + fx * texel(l, x1, y1);
 
-    std::vector<Color > texture;
+        return (1 - fy) * top + fy * bottom;
+    }
 
 public:
     // default constructor
@@ -22,47 +385,75 @@ public:
         initialized = false;
     }
 
-    // This constructor will read an image and create a 2D array (represented in 1D)
-    // with the pixel (Color) data of the image
-    Texture(std::string filename) {
+    // The texture of an image file, with its texels kept in 'format'
+    // (TEXTURE_8BIT or TEXTURE_HALF). The file is read on the first lookup
+    Texture(std::string filename, int format = TEXTURE_8BIT) {
         initialized = true;
-        sf::Image image;
-        if (!image.loadFromFile(filename)) {
-            std::cerr << "Error: When loading file '" << filename << std::endl;
-            exit(1);
-        }
+        image = textureCache().open(filename, format);
+    }
+
+    bool isInitialized() {
+        return initialized;
+    }
 
-        sf::Vector2u size = image.getSize();
-        width = size.x;
-        height = size.y;
+    // same file in the same format
+    bool operator== (const Texture &other) const {
+        return initialized == other.initialized && image == other.image;
+    }
 
-        for (int j = 0; j < height; ++j) {
-            for (int i = 0; i < width; ++i) {
-                sf::Color c = image.getPixel(i,j);
-                texture.push_back( Color( double(c.r)/255.0,
-                                          double(c.g)/255.0,
-                                          double(c.b)/255.0 ) );
-            }
-        }
+    // equal textures hash the same
+    size_t hash() const {
+        return std::hash<const void*>()(image.get());
+    }
+
+    // 0 if no file was given
+    int getNumLevels() {
+        if (!initialized)
+            return 0;
 
+        textureCache().ensureLoaded(*image);
+        return image->levelWidth.size();
     }
 
-    bool isInitialized() {
-        return initialized;
+    // Filtered lookup. footprint is how much of the texture (as a part of its
+    // width) the pixel covers, it picks the two mip levels to blend, 0 for
+    // just the full size image
+    Color getColorUV(double u, double v, double footprint, bool wrapU = false) {
+        textureCache().ensureLoaded(*image);
+
+        if (!wrapU)
+            u = std::min(std::max(u, 0.0), 1.0);
+
+        double lod = (footprint > 0) ? std::log2(footprint * image->width) : 0.0;
+        double maxLevel = image->levelWidth.size() - 1;
+
+        if (lod <= 0)
+            return bilinear(0, u, v, wrapU);
+        if (lod >= maxLevel)
+            return bilinear(maxLevel, u, v, wrapU);
+
+        int l = (int)lod;
+        double f = lod - l;
+
+        return (1 - f) * bilinear(l, u, v, wrapU) + f * bilinear(l + 1, u, v, wrapU);
+    }
+
+    // u and v between 0 and 1, (0,0) is the top left pixel
+    Color getColorUV(double u, double v) {
+        return getColorUV(u, v, 0.0);
     }
 
-    // Assumes a 2:1 aspect ratio texture
-    Color getColorSphericalMapping(Point c, double r, Point p) {
+    // Assumes a 2:1 aspect ratio texture. footprint is the world space size
+    // the pixel covers around p
+    Color getColorSphericalMapping(Point c, double r, Point p, double footprint = 0) {
         Vector local(p.x-c.x,p.y-c.y,p.z-c.z);
         normalize(local);
 
         double u = 0.5 + atan2(local.x,local.z) / (2.0 * PI);
         double v = 0.5 - asin(local.y) / PI;
 
-        int row = (int) (height - 1) * v;
-        int col = (int) (width - 1) * u;
-
-        return texture[row * width + col];
+        // the texture goes once around the sphere
+        return getColorUV(u, v, footprint / (2.0 * PI * r), true);
     }
 };
 
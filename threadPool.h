@@ -0,0 +1,184 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+/*
+ * The ThreadPool class.
+ *
+ * A fixed set of worker threads fed from a single task queue. Threads waiting
+ * on a task (get, parallelFor) run queued tasks themselves in the meantime,
+ * so tasks can submit and wait on other tasks without starving the pool.
+ *
+ * Use threadPool() to get the one shared by the whole program, so rendering,
+ * tree building and post processing never start threads of their own.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void workerLoop () {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+                if (stopping && tasks.empty())
+                    return;
+
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    ThreadPool ( int numThreads = std::thread::hardware_concurrency() ) {
+        if (numThreads < 1)
+            numThreads = 1;
+
+        for (int i = 0; i < numThreads; ++i)
+            workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool () {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+
+        for (unsigned int i = 0; i < workers.size(); ++i)
+            workers[i].join();
+    }
+
+    ThreadPool ( const ThreadPool& ) = delete;
+    ThreadPool& operator= ( const ThreadPool& ) = delete;
+
+    int size () {
+        return workers.size();
+    }
+
+    // queue f to run on the pool, the future holds whatever it returns
+    template <typename F>
+    auto submit (F f) -> std::future<decltype(f())> {
+        typedef decltype(f()) result;
+        std::shared_ptr<std::packaged_task<result()> > task = std::make_shared<std::packaged_task<result()> >(f);
+        std::future<result> future = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            tasks.push_back([task] { (*task)(); });
+        }
+        condition.notify_one();
+
+        return future;
+    }
+
+    // runs one queued task on the calling thread, false if there was none
+    bool runPendingTask () {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (tasks.empty())
+                return false;
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        return true;
+    }
+
+    // join: wait for a task, helping with the queue while it isn't done
+    template <typename T>
+    void wait (std::future<T> &future) {
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (!runPendingTask())
+                future.wait_for(std::chrono::microseconds(100));
+        }
+    }
+
+    template <typename T>
+    T get (std::future<T> &future) {
+        wait(future);
+        return future.get();
+    }
+
+    // body(i) for every i in [begin, end), handed out 'grain' indices at a
+    // time. The calling thread works too and returns when everything is done.
+    template <typename F>
+    void parallelFor (int begin, int end, F body, int grain = 1) {
+        if (begin >= end)
+            return;
+
+        if (grain < 1)
+            grain = 1;
+
+        std::shared_ptr<std::atomic<int> > next = std::make_shared<std::atomic<int> >(begin);
+
+        auto work = [=] () {
+            while (true) {
+                int first = next->fetch_add(grain);
+                if (first >= end)
+                    break;
+
+                int last = std::min(first + grain, end);
+                for (int i = first; i < last; ++i)
+                    body(i);
+            }
+        };
+
+        int chunks = (end - begin + grain - 1) / grain;
+        int helpers = std::min(size(), chunks - 1);
+
+        std::vector<std::future<void> > futures;
+        for (int i = 0; i < helpers; ++i)
+            futures.push_back(submit(work));
+
+        work();
+
+        for (unsigned int i = 0; i < futures.size(); ++i)
+            wait(futures[i]);
+    }
+};
+
+// set in a forked process, see restartThreadPoolAfterFork
+ThreadPool*& forkedThreadPool () {
+    static ThreadPool *pool = NULL;
+    return pool;
+}
+
+// The pool shared by everything, created on first use
+ThreadPool& threadPool () {
+    if (forkedThreadPool())
+        return *forkedThreadPool();
+
+    static ThreadPool pool;
+    return pool;
+}
+
+// A forked process gets a copy of the parent's pool but none of its threads,
+// and its lock may have been held by one of them. Call this in the child
+// right after the fork, before anything uses the pool, to give it a pool of
+// its own with numThreads threads. The parent's copy is left alone.
+void restartThreadPoolAfterFork ( int numThreads ) {
+    forkedThreadPool() = new ThreadPool(numThreads);
+}
+
+#endif
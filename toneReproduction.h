@@ -2,70 +2,378 @@
 #define _TONEREPRODUCTION_H
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 
 #include "mathHelper.h"
+#include "threadPool.h"
+#include "framebuffer.h"
 
 #define LDMAX 500 // maximum display luminance, 500 for standard CRTs
 
-std::vector<double> getLuminance( std::vector<Color> colorMap ) {
-    std::vector<double> luminance;
+// pixels per block of the log-average sum, each block is summed on its own
+// and the block sums added at the end, so the result doesn't depend on the
+// number of threads
+#define TONE_BLOCK 16384
 
-    for(unsigned int i = 0; i < colorMap.size(); ++i) {
-        Color c = colorMap[i];
-        luminance.push_back(0.27 * c.r + 0.67 * c.g + 0.06 * c.b);
-    }
+// RunningToneMap freezes its key once it is within TONE_KEY_TOLERANCE
+// (relative) of the whole frame's with 95% confidence. The estimate needs a
+// few tiles to mean anything, so also not before TONE_MIN_TILES tiles and
+// TONE_MIN_COVERAGE of the pixels are in
+#define TONE_KEY_TOLERANCE 0.05
+#define TONE_MIN_TILES 32
+#define TONE_MIN_COVERAGE 0.1
 
-    return luminance;
+// body(i) for every pixel, on the pool with MULTI_THREADED
+template <typename F>
+void forEachColor( int size, F body ) {
+    #ifdef MULTI_THREADED
+        threadPool().parallelFor(0, size, body, 4096);
+    #else
+        for(int i = 0; i < size; ++i)
+            body(i);
+    #endif
 }
 
-double logAverage( std::vector<double> luminance ) { 
-    double sum = 0;
+// Log average luminance of size pixels once scaled by Lmax, luminanceOf(i)
+// being the luminance of pixel i, without building a scaled copy or a
+// luminance map first
+template <typename F>
+double logAverage( int size, double Lmax, F luminanceOf ) {
     double delta = 0.000000001; // don't want log of 0
 
-    for(unsigned int i = 0; i < luminance.size(); ++i)
-        sum += std::log( delta + luminance[i] );
+    int blocks = (size + TONE_BLOCK - 1) / TONE_BLOCK;
+    std::vector<double> blockSum(blocks, 0.0);
+
+    auto sumBlock = [&](int block) {
+        int first = block * TONE_BLOCK;
+        int last = std::min(first + TONE_BLOCK, size);
+
+        double sum = 0;
+        for(int i = first; i < last; ++i)
+            sum += std::log( delta + Lmax * luminanceOf(i) );
+
+        blockSum[block] = sum;
+    };
+
+    #ifdef MULTI_THREADED
+        threadPool().parallelFor(0, blocks, sumBlock, 1);
+    #else
+        for(int block = 0; block < blocks; ++block)
+            sumBlock(block);
+    #endif
 
-    return std::exp( sum / luminance.size() );
+    double sum = 0;
+    for(int block = 0; block < blocks; ++block)
+        sum += blockSum[block];
+
+    return std::exp( sum / size );
 }
 
-std::vector<Color> compressionPerceptual( std::vector<Color> colorMap, double Lmax ) {
-    // maximum luminance in the scene
-    for(unsigned int i = 0; i < colorMap.size(); ++i)
-        colorMap[i] = Lmax * colorMap[i];
+double logAverage( const std::vector<Color> &colorMap, double Lmax ) {
+    return logAverage(colorMap.size(), Lmax, [&](int i) {
+        return luminance(colorMap[i]);
+    });
+}
+
+template <typename T>
+double logAverage( const Framebuffer<T> &framebuffer, double Lmax ) {
+    int width = framebuffer.getWidth();
 
-    double Lwa = std::pow( logAverage ( getLuminance(colorMap) ) , 0.4 ) ; 
+    return logAverage(width * framebuffer.getHeight(), Lmax, [&](int i) {
+        return luminance(framebuffer.get(i % width, i / width));
+    });
+}
+
+// Perceptual operator scale for a given log average, see toneMapPerceptual
+double perceptualScale( double logAvg, double Lmax ) {
+    double Lwa = std::pow( logAvg , 0.4 ) ;
     double sf = std::pow( ( ( 1.219 + std::pow( LDMAX / 2.0 , 0.4) ) / (1.219 + Lwa) ) , 2.5);
 
-    std::vector<Color> colorFinal;
+    return Lmax * sf / LDMAX;
+}
+
+// The tone operators work in place over the color map: one pass for the log
+// average and one for the compression, no copies.
+
+void toneMapPerceptual( std::vector<Color> &colorMap, double Lmax ) {
+    // maximum luminance in the scene is Lmax
+    double scale = perceptualScale( logAverage(colorMap, Lmax), Lmax );
+
+    forEachColor(colorMap.size(), [&](int i) {
+        colorMap[i] = scale * colorMap[i];
+    });
+}
+
+void toneMapPhotographic( std::vector<Color> &colorMap, double Lmax ) {
+    double a = 0.18;
+    double Lavg = logAverage(colorMap, Lmax);
+
+    double scale = a * Lmax / Lavg;
+
+    forEachColor(colorMap.size(), [&](int i) {
+        Color scaledColor = scale * colorMap[i];
+        colorMap[i] = Color( scaledColor.r / (1.0+scaledColor.r) ,
+                             scaledColor.g / (1.0+scaledColor.g) ,
+                             scaledColor.b / (1.0+scaledColor.b) );
+    });
+}
+
+/*
+ * The RunningToneMap class.
+ *
+ * Log average of the tiles rendered so far, for the perceptual operator. With
+ * the tiles coming in scattered over the image, the ones done so far are a
+ * random sample of the frame, so the spread of their log averages tells how
+ * far the key can still be from the final one. Once that is small enough the
+ * key is frozen and every tile from then on can be tone mapped as soon as it
+ * is done. addTile is thread safe.
+ */
+class RunningToneMap {
+    double Lmax;
+    long totalPixels;
+
+    std::mutex mutex;
+    double logSum = 0;
+    long count = 0;
+
+    // running mean and squared deviations of the tiles' mean log luminance
+    int tiles = 0;
+    double tileMean = 0, tileM2 = 0;
+
+    // 0 until frozen, and the operator's scale for it
+    double frozenKey = 0;
+    double frozenScale = 0;
+
+    void setKey( double key ) {
+        frozenKey = key;
+        frozenScale = perceptualScale(key, Lmax);
+    }
+
+public:
+    RunningToneMap( double Lmax, long totalPixels ) : Lmax(Lmax), totalPixels(totalPixels) {}
+
+    // true if the key is frozen (maybe by this tile)
+    bool addTile( const std::vector<Color> &tile ) {
+        double delta = 0.000000001; // don't want log of 0
+
+        double sum = 0;
+        for(unsigned int i = 0; i < tile.size(); ++i)
+            sum += std::log( delta + Lmax * luminance(tile[i]) );
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (frozenKey > 0)
+            return true;
+
+        logSum += sum;
+        count += tile.size();
+
+        double x = sum / tile.size();
+        tiles++;
+        double d = x - tileMean;
+        tileMean += d / tiles;
+        tileM2 += d * (x - tileMean);
+
+        double covered = double(count) / totalPixels;
+
+        if (tiles >= TONE_MIN_TILES && covered >= TONE_MIN_COVERAGE) {
+            // standard error of the log key, the tiles left are what is unknown
+            double error = std::sqrt( tileM2 / (tiles - 1) / tiles * (1.0 - covered) );
+
+            if (2.0 * error <= std::log(1.0 + TONE_KEY_TOLERANCE))
+                setKey( std::exp( logSum / count ) );
+        }
+
+        return frozenKey > 0;
+    }
+
+    // freezes the key with whatever is in, e.g. once the whole frame is
+    void freeze() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (frozenKey == 0)
+            setKey( (count > 0) ? std::exp( logSum / count ) : 1.0 );
+    }
+
+    // color to display, 0 to 1 (or more, clamp when quantizing)
+    Color map( const Color &c ) {
+        return frozenScale * c;
+    }
 
-    for(unsigned int i = 0; i < colorMap.size(); ++i) {
-        Color colorTarget = sf * colorMap[i];
-        colorFinal.push_back( colorTarget / LDMAX );
+    double getKey() {
+        return frozenKey;
     }
-    
-    return colorFinal;
+};
+
+// rows blurred together along x, so the inner loop walks contiguous memory
+#define BLUR_BAND 16
+
+// Radius of each of three box blurs that together blur about like a gaussian
+// of sigma. Two widths are mixed to get close to the right variance.
+void boxesForGauss( double sigma, int radius[3] ) {
+    double ideal = std::sqrt(4.0 * sigma * sigma + 1.0);
+
+    int wl = (int)std::floor(ideal);
+    if (wl % 2 == 0)
+        wl--;
+    int wu = wl + 2;
+
+    int m = (int)std::lround( (12.0 * sigma * sigma - 3.0 * wl * wl - 12.0 * wl - 9.0) / (-4.0 * wl - 4.0) );
+
+    for(int pass = 0; pass < 3; ++pass)
+        radius[pass] = ((pass < m) ? wl : wu) / 2;
 }
 
-std::vector<Color> compressionPhotographic( std::vector<Color> colorMap, double Lmax ) {
-    // maximum luminance in the scene
-    for(unsigned int i = 0; i < colorMap.size(); ++i)
-        colorMap[i] = Lmax * colorMap[i];
+// Box blur of radius r along y, over column x of a width x height map
+// (column after column, like the color maps). A running sum, so the cost
+// doesn't depend on r. The border values are repeated past the edges.
+void boxBlurColumn( std::vector<double> &data, int height, int x, int r, std::vector<double> &copy ) {
+    double *column = &data[x * height];
+    copy.assign(column, column + height);
+
+    double sum = (r + 1) * copy[0];
+    for(int k = 1; k <= r; ++k)
+        sum += copy[std::min(k, height - 1)];
+
+    for(int k = 0; k < height; ++k) {
+        column[k] = sum / (2 * r + 1);
+
+        sum += copy[std::min(k + r + 1, height - 1)];
+        sum -= copy[std::max(k - r, 0)];
+    }
+}
+
+// Same along x, for the rows y0 to y1 together
+void boxBlurRows( std::vector<double> &data, int width, int height, int y0, int y1, int r, std::vector<double> &copy ) {
+    int band = y1 - y0;
+    copy.resize(width * band);
+
+    for(int x = 0; x < width; ++x)
+        for(int b = 0; b < band; ++b)
+            copy[x * band + b] = data[x * height + y0 + b];
+
+    double sum[BLUR_BAND];
+    for(int b = 0; b < band; ++b) {
+        sum[b] = (r + 1) * copy[b];
+        for(int k = 1; k <= r; ++k)
+            sum[b] += copy[std::min(k, width - 1) * band + b];
+    }
+
+    for(int x = 0; x < width; ++x) {
+        double *out = &data[x * height + y0];
+        double *in = &copy[std::min(x + r + 1, width - 1) * band];
+        double *gone = &copy[std::max(x - r, 0) * band];
+
+        for(int b = 0; b < band; ++b) {
+            out[b] = sum[b] / (2 * r + 1);
+            sum[b] += in[b] - gone[b];
+        }
+    }
+}
+
+// Gaussian blur of a width x height map, three box blurs along x and then
+// three along y
+void gaussianBlur( std::vector<double> &data, int width, int height, double sigma ) {
+    int radius[3];
+    boxesForGauss(sigma, radius);
 
+    int bands = (height + BLUR_BAND - 1) / BLUR_BAND;
+
+    auto blurBand = [&](int band) {
+        std::vector<double> copy;
+        int y0 = band * BLUR_BAND;
+        int y1 = std::min(y0 + BLUR_BAND, height);
+
+        for(int pass = 0; pass < 3; ++pass)
+            if (radius[pass] > 0)
+                boxBlurRows(data, width, height, y0, y1, radius[pass], copy);
+    };
+
+    auto blurColumn = [&](int x) {
+        std::vector<double> copy;
+        for(int pass = 0; pass < 3; ++pass)
+            if (radius[pass] > 0)
+                boxBlurColumn(data, height, x, radius[pass], copy);
+    };
+
+    #ifdef MULTI_THREADED
+        threadPool().parallelFor(0, bands, blurBand, 1);
+        threadPool().parallelFor(0, width, blurColumn, 16);
+    #else
+        for(int band = 0; band < bands; ++band)
+            blurBand(band);
+        for(int x = 0; x < width; ++x)
+            blurColumn(x);
+    #endif
+}
+
+// Reinhard's local operator (dodging and burning). Each pixel is compressed
+// by the average luminance around it instead of the whole image's, over the
+// largest neighborhood (of 8 scales) that has no strong edge in it, so bright
+// lights and dark corners keep their local contrast.
+void toneMapLocal( std::vector<Color> &colorMap, int width, int height, double Lmax ) {
     double a = 0.18;
-    double Lavg = logAverage ( getLuminance(colorMap) );
+    double phi = 8.0;
+    double epsilon = 0.05;
+    int numScales = 8;
+
+    int size = colorMap.size();
+    double key = a * Lmax / logAverage(colorMap, Lmax);
+
+    // scaled luminance
+    std::vector<double> L(size);
+    forEachColor(size, [&](int i) {
+        L[i] = key * luminance(colorMap[i]);
+    });
+
+    // center/surround blurs of consecutive scales, only two are kept at a time
+    double scale = 1.0;
+    double alpha = 0.35;
+
+    std::vector<double> center(L);
+    gaussianBlur(center, width, height, alpha * scale / std::sqrt(2.0));
+
+    std::vector<double> adaptation(center);
+    std::vector<char> done(size, 0);
 
-    std::vector<Color> colorFinal;
+    for(int s = 0; s < numScales; ++s) {
+        std::vector<double> surround(L);
+        gaussianBlur(surround, width, height, alpha * scale * 1.6 / std::sqrt(2.0));
 
-    for(unsigned int i = 0; i < colorMap.size(); ++i) {
-        Color scaledColor = a * colorMap[i] / Lavg;
-        Color colorTarget( (scaledColor.r / (1.0+scaledColor.r)) * LDMAX , 
-                           (scaledColor.g / (1.0+scaledColor.g)) * LDMAX , 
-                           (scaledColor.b / (1.0+scaledColor.b)) * LDMAX );
-        colorFinal.push_back( colorTarget / LDMAX );
+        double norm = std::pow(2.0, phi) * a / (scale * scale);
+
+        forEachColor(size, [&](int i) {
+            if (done[i])
+                return;
+
+            double v = (center[i] - surround[i]) / (norm + center[i]);
+            if (std::fabs(v) < epsilon)
+                adaptation[i] = center[i];
+            else
+                done[i] = 1;
+        });
+
+        center.swap(surround);
+        scale *= 1.6;
     }
 
-    return colorFinal;
+    forEachColor(size, [&](int i) {
+        colorMap[i] = (key / (1.0 + adaptation[i])) * colorMap[i];
+    });
+}
+
+// Copying versions, the color map given is left as it was
+
+std::vector<Color> compressionPerceptual( std::vector<Color> colorMap, double Lmax ) {
+    toneMapPerceptual(colorMap, Lmax);
+    return colorMap;
+}
+
+std::vector<Color> compressionPhotographic( std::vector<Color> colorMap, double Lmax ) {
+    toneMapPhotographic(colorMap, Lmax);
+    return colorMap;
 }
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,9 @@
 #ifndef _TRANSFORM_H
 #define _TRANSFORM_H
 
+#include <limits>
+#include <algorithm>
+#include <cmath>
 #include "mathHelper.h"
 #include "object.h"
 
@@ -26,4 +29,225 @@ void scale (Object *obj, double sx, double sy, double sz) {
     obj->setPoints(result);
 }
 
+/*
+ * The Transform class.
+ *
+ * An affine transform and its inverse. The inverse is built together with
+ * the matrix (inverting each factor is trivial) so we never need a general
+ * 4x4 inversion.
+ */
+struct Transform {
+    Mat4 matrix;
+    Mat4 inverse;
+
+    Transform () : matrix(Mat4::identity()), inverse(Mat4::identity()) {}
+
+    Transform ( Mat4 matrix, Mat4 inverse ) : matrix(matrix), inverse(inverse) {}
+
+    static Transform translation (double tx, double ty, double tz) {
+        return Transform(Mat4(1,0,0, tx, 0,1,0, ty, 0,0,1, tz, 0,0,0,1),
+                         Mat4(1,0,0,-tx, 0,1,0,-ty, 0,0,1,-tz, 0,0,0,1));
+    }
+
+    static Transform scaling (double sx, double sy, double sz) {
+        return Transform(Mat4(sx,0,0,0,   0,sy,0,0,   0,0,sz,0,   0,0,0,1),
+                         Mat4(1/sx,0,0,0, 0,1/sy,0,0, 0,0,1/sz,0, 0,0,0,1));
+    }
+
+    // rotation of 'degrees' around an axis going through the origin
+    static Transform rotation (double degrees, Vector axis) {
+        normalize(axis);
+        double a = degrees * PI / 180.0;
+        double c = std::cos(a), s = std::sin(a), t = 1.0 - c;
+        double x = axis.x, y = axis.y, z = axis.z;
+
+        Mat4 r(t*x*x + c,   t*x*y - s*z, t*x*z + s*y, 0,
+               t*x*y + s*z, t*y*y + c,   t*y*z - s*x, 0,
+               t*x*z - s*y, t*y*z + s*x, t*z*z + c,   0,
+               0,           0,           0,           1);
+
+        return Transform(r, r.transpose());
+    }
+
+    // composition, rhs is applied first
+    Transform operator* (const Transform& rhs) const {
+        return Transform(matrix * rhs.matrix, rhs.inverse * inverse);
+    }
+
+    // world space ray into object space, the direction is normalized again
+    // so distances used by the objects and trees stay meaningful
+    Ray toObject (Ray ray) const {
+        Vector d = inverse * ray.getDirection();
+        normalize(d);
+        return Ray(inverse * ray.getOrigin(), d);
+    }
+
+    // normals go through the inverse transpose
+    Vector normalToWorld (const Vector &n) const {
+        Vector result = inverse.linear().transpose() * n;
+        normalize(result);
+        return result;
+    }
+
+    // the most the inverse stretches a length (its longest column), so a
+    // world space footprint times this covers the footprint in object space
+    double inverseScale () const {
+        Mat3 l = inverse.linear();
+        double result = 0.0;
+
+        for (int j = 0; j < 3; ++j)
+            result = std::max(result, std::sqrt(l.m[j]*l.m[j] + l.m[3+j]*l.m[3+j] + l.m[6+j]*l.m[6+j]));
+
+        return result;
+    }
+};
+
+/*
+ * The Instance class.
+ *
+ * Places an object in the world through a transform, without touching its
+ * geometry. Rays are moved into the object's space instead, so the same
+ * object (usually a Mesh with its own tree) can be added many times.
+ *
+ * The instance starts with the object's material (the same id in the
+ * material table), set it up on the object first or call setUpPhong etc. on
+ * the instance to give each copy its own.
+ */
+class Instance : public Object {
+    Object *object;
+    Transform transform;
+
+    // world box, kept up to date with the transform so rays that miss it are
+    // rejected before being moved to the object space
+    Voxel bounds;
+
+    void updateBounds () {
+        Voxel local = object->getBounds();
+        bounds = Voxel(transform.matrix * local.corner(0));
+
+        for (int i = 1; i < 8; ++i)
+            bounds.extend(transform.matrix * local.corner(i));
+    }
+
+public:
+    Instance ( Object *object, Transform transform = Transform() ) : object(object), transform(transform) {
+        setMaterial(object->getMaterial());
+
+        updateBounds();
+    }
+
+    Object* getObject() {
+        return object;
+    }
+
+    Transform getTransform() {
+        return transform;
+    }
+
+    void setTransform(Transform t) {
+        transform = t;
+        updateBounds();
+    }
+
+    // t is applied after whatever the instance already had
+    void applyTransform(Transform t) {
+        transform = t * transform;
+        updateBounds();
+    }
+
+    Point intersect (Ray ray) {
+        if (!bounds.intersect(ray, 0, std::numeric_limits<double>::max()))
+            return ray.getOrigin();
+
+        Ray local = transform.toObject(ray);
+        Point localOrigin = local.getOrigin();
+        Point hit = object->intersect(local);
+
+        // no intersection, return the origin of the ray like everyone else
+        if (hit == localOrigin)
+            return ray.getOrigin();
+
+        return transform.matrix * hit;
+    }
+
+    std::vector<Point> samplePoints(int numSamples) {
+        std::vector<Point> samples = object->samplePoints(numSamples);
+
+        for(std::vector<Point>::iterator it = samples.begin() ; it < samples.end() ; ++it)
+            *it = transform.matrix * (*it);
+
+        return samples;
+    }
+
+    // the world box of the instance might be a bit bigger than the object
+    // (transformed box of a box), which is fine for the trees
+    bool isInside (Voxel v) {
+        return bounds.overlaps(v);
+    }
+
+    Vector getNormal (Point p) {
+        return transform.normalToWorld( object->getNormal(transform.inverse * p) );
+    }
+
+    // a procedural texture on the instance is looked up in the object's
+    // space too, so it moves with the instance
+    Color getColor (Point p, double footprint) {
+        ProceduralTexture *procedural = getMaterialRecord().procedural;
+        if (procedural != NULL)
+            return procedural->getColor(transform.inverse * p, 0, 0);
+
+        return object->getColor(transform.inverse * p, footprint * transform.inverseScale());
+    }
+
+    void getColors (const Point *p, const double *footprint, int n, Color *out) {
+        std::vector<Point> local(n);
+        for (int i = 0; i < n; ++i)
+            local[i] = transform.inverse * p[i];
+
+        ProceduralTexture *procedural = getMaterialRecord().procedural;
+        if (procedural != NULL) {
+            std::vector<double> zero(n, 0.0);
+            procedural->getColors(&local[0], &zero[0], &zero[0], n, out);
+        }
+        else {
+            double scale = transform.inverseScale();
+            std::vector<double> localFootprint(n);
+            for (int i = 0; i < n; ++i)
+                localFootprint[i] = footprint[i] * scale;
+
+            object->getColors(&local[0], &localFootprint[0], n, out);
+        }
+    }
+
+    // The instance is handled as a single point, its origin. Moving it with
+    // translate() moves the whole instance, the object is never changed.
+    void setPoints (std::vector<Point> vertices) {
+        Point origin = transform.matrix * Point(0,0,0);
+        applyTransform(Transform::translation(vertices[0].x - origin.x,
+                                              vertices[0].y - origin.y,
+                                              vertices[0].z - origin.z));
+    }
+
+    std::vector<Point> getPoints () {
+        return std::vector<Point>(1, transform.matrix * Point(0,0,0));
+    }
+
+    Voxel getBounds () {
+        return bounds;
+    }
+};
+
+// Instances get their transform updated instead of having points rewritten
+void translate (Instance *inst, double tx, double ty, double tz) {
+    inst->applyTransform(Transform::translation(tx, ty, tz));
+}
+
+void scale (Instance *inst, double sx, double sy, double sz) {
+    inst->applyTransform(Transform::scaling(sx, sy, sz));
+}
+
+void rotate (Instance *inst, double degrees, Vector axis) {
+    inst->applyTransform(Transform::rotation(degrees, axis));
+}
+
 #endif
@@ -6,6 +6,8 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <functional>
+#include <random>
 #include "mathHelper.h"
 #include "object.h"
 #include "lightSource.h"
@@ -16,6 +18,13 @@
 #define CONSTANT_DENSITY 0
 #define VARIABLE_DENSITY 1
 
+// reflected and transmitted rays adding less than this to the pixel go
+// through the Russian roulette
+#define ROULETTE_WEIGHT 0.1
+
+// rays handled together by one thread in a wavefront stage
+#define WAVEFRONT_CHUNK 256
+
 class World {
     // List of objects in this world
     std::vector<Object*> objectList;
@@ -34,28 +43,96 @@ class World {
     // Index of refraction
     double nr;
 
-    // pointer to a illuminate function (could be phong, phongblinn, etc)
-    Color (*illuminate)(Object*, Vector, Point, Vector, std::map<LightSource*, std::vector<Point> >);// = NULL;
+    // illumination model to shade with (ILLUMINATION_PHONG etc.). The
+    // tracing loops are instantiated once for each model, this picks which
+    // one runs, so the model itself is inlined in the shading
+    int illuminationModel;
 
-    // tree
+    // top level tree, over the objects added to the world. Meshes keep their
+    // own tree, so rebuilding this one only costs as much as the object count
     Kdtree kd;
+    Voxel kdVoxel;
+
+    // a reflected or transmitted ray waiting to be traced, weight is how much
+    // it adds to the pixel in the end (product of the kr and kt on the way),
+    // travelled how far it is from the camera along the path
+    struct secondaryRay {
+        Ray ray;
+        int depth;
+        double weight;
+        double travelled;
+
+        secondaryRay (Ray ray, int depth, double weight, double travelled = 0) : ray(ray), depth(depth), weight(weight), travelled(travelled) {}
+    };
+
+    // what shading a hit needs besides the lights, worked out before its
+    // shadow rays are traced
+    struct surfaceHit {
+        Vector normal;
+        double travelled;
+        Color color;
+        Point shadowOrigin;
+    };
+
+    // a shadow ray of a wavefront batch, from hit k towards a point on a
+    // light lightDistance away (only used without the tree)
+    struct shadowRay {
+        Ray ray;
+        LightSource *light;
+        Point lightPoint;
+        double lightDistance;
+        int hit;
+        bool blocked;
+
+        shadowRay (Ray ray, LightSource *light, Point lightPoint, double lightDistance, int hit) :
+            ray(ray), light(light), lightPoint(lightPoint), lightDistance(lightDistance), hit(hit), blocked(false) {}
+    };
+
+    // angle a pixel covers, set by the camera. The texture footprint at a hit
+    // is this times the distance along the path, as if every surface on the
+    // way were flat. 0 samples the textures at full size
+    double pixelSpread = 0;
+
+    // bounds of each object when it was last put in the tree, so we can
+    // tell which ones moved
+    std::vector<Voxel> kdBounds;
+
+    void recordKdBounds() {
+        kdBounds.clear();
+        for(std::vector<Object*>::iterator it = objectList.begin() ; it < objectList.end() ; ++it)
+            kdBounds.push_back((*it)->getBounds());
+    }
 
 public:
 
     // All world needs to be created is an index of refraction
     // which is set as 1 by default if no value is specified
     World (double nr = 1) : nr(nr) {
-        illuminate = NULL;
+        illuminationModel = ILLUMINATION_NONE;
     }
 
-    void setUpPhongIllumination(Color amLight) {
+    // model is one of the ILLUMINATION_ values from "illuminationModel.h"
+    void setUpIllumination(int model, Color amLight) {
+        if (model != ILLUMINATION_PHONG && model != ILLUMINATION_PHONG_BLINN && model != ILLUMINATION_LAMBERT) {
+            std::cerr << "Error: Unknown illumination model " << model << "." << std::endl;
+            exit(1);
+        }
+
         backgroundRadiance = amLight;
-        illuminate = illuminatePhong; // from "illuminationModel.h"
+        illuminationModel = model;
+    }
+
+    void setUpPhongIllumination(Color amLight) {
+        setUpIllumination(ILLUMINATION_PHONG, amLight);
     }
 
     void setUpPhongBlinnIllumination(Color amLight) {
-        backgroundRadiance = amLight;
-        illuminate = illuminatePhongBlinn; // from "illuminationModel.h"
+        setUpIllumination(ILLUMINATION_PHONG_BLINN, amLight);
+    }
+
+    // angle one pixel covers (the camera sets it), for the texture filtering
+    void setPixelSpread(double spread) {
+        pixelSpread = spread;
     }
 
     void addObject(Object *obj) {
@@ -76,11 +153,88 @@ public:
     // Creates a KDtree based on the added objects,
     // uses as the main voxel the values passed for now
     void createKdTree(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax ) {
-        kd = Kdtree(objectList, Voxel(xmin,xmax,ymin,ymax,zmin,zmax));
+        kdVoxel = Voxel(xmin,xmax,ymin,ymax,zmin,zmax);
+        kd.build(objectList, kdVoxel);
+        recordKdBounds();
+    }
+
+    // Same thing, but the main voxel is the box around every object
+    void createKdTree() {
+        if (objectList.empty())
+            return;
+
+        Voxel bounds = objectList[0]->getBounds();
+        for(std::vector<Object*>::iterator it = objectList.begin() ; it < objectList.end() ; ++it)
+            bounds.extend((*it)->getBounds());
+
+        bounds = bounds.grow(1e-6);
+        createKdTree(bounds.xLeft, bounds.xRight, bounds.yBottom, bounds.yTop, bounds.zFar, bounds.zNear);
+    }
+
+    // Rebuild the tree with the same main voxel after objects were added or
+    // moved (e.g. an instance got a new transform). Only the top level is
+    // rebuilt, the trees inside meshes are kept.
+    void updateKdTree() {
+        kd.build(objectList, kdVoxel);
+        recordKdBounds();
+    }
+
+    // For animations: only the objects whose bounds changed since the last
+    // build (and the ones added since) are moved around in the tree, leaves
+    // that get too crowded are split on their own. If something leaves the
+    // main voxel we fall back to a full build around the objects.
+    void refitKdTree() {
+        if ( !kd.exists() ) {
+            createKdTree();
+            return;
+        }
+
+        for (unsigned int i = 0; i < objectList.size(); ++i) {
+            Voxel bounds = objectList[i]->getBounds();
+
+            if ( i < kdBounds.size() && bounds == kdBounds[i] )
+                continue;
+
+            if ( !kdVoxel.contains(bounds) ) {
+                createKdTree();
+                return;
+            }
+
+            // slack so leaves that hold the object because of rounding in the
+            // overlap tests are still visited
+            if ( i < kdBounds.size() ) {
+                kd.remove(objectList[i], kdBounds[i].grow(1e-6));
+                kdBounds[i] = bounds;
+            } else {
+                kdBounds.push_back(bounds);
+            }
+
+            kd.insert(objectList[i]);
+        }
+    }
+
+    // Russian roulette: a branch that would add less than ROULETTE_WEIGHT to
+    // the pixel only goes on with probability weight / ROULETTE_WEIGHT, and
+    // is then scaled up by the inverse so the pixel stays the same on average.
+    // Returns that scale, 0 if the branch is cut off.
+    double roulette ( double weight ) {
+        if (weight >= ROULETTE_WEIGHT)
+            return 1.0;
+
+        // every pool thread draws from its own generator, seeded once from
+        // rand() so a srand() before rendering still fixes the result
+        static thread_local std::mt19937 generator(rand());
+        static thread_local std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        double survival = weight / ROULETTE_WEIGHT;
+        if (uniform(generator) < survival)
+            return 1.0 / survival;
+
+        return 0.0;
     }
 
     Color spawn ( Ray ray, int depth ) {
-        if (illuminate == NULL) {
+        if (illuminationModel == ILLUMINATION_NONE) {
             std::cerr << "Error: World needs to have illumination setup before rendering." << std::endl;
             exit(1);
         }
@@ -96,110 +250,274 @@ public:
 
     // Spawn will return the color we should use for the pixel in the ray
     Color spawnKdtree( Ray ray, int depth ) {
-        Point originRay = ray.getOrigin();
+        return trace(ray, depth, true);
+    }
 
-        // walk through the tree, get the object the ray hits
-        Object* objectHit = kd.traverse(ray);
+    // Same without the tree, every object is tried
+    Color spawnIlluminated( Ray ray, int depth ) {
+        return trace(ray, depth, false);
+    }
 
-        // if nothing was hit
-        if (objectHit == NULL) {
-            return backgroundRadiance;
-        } else {
-            Point pointHit = objectHit->intersect(ray);
+    // The pixel color is the local color at every hit along the way, times
+    // the kr and kt it went through to get there. So instead of recursing,
+    // the reflected and transmitted rays go on a stack with that weight and
+    // their colors are added up as they come off it.
+    Color trace( Ray ray, int depth, bool useTree ) {
+        switch (illuminationModel) {
+            case ILLUMINATION_NONE:
+                std::cerr << "Error: World needs to have illumination setup before rendering." << std::endl;
+                exit(1);
+            case ILLUMINATION_PHONG_BLINN:
+                return traceWith<PhongBlinnModel>(ray, depth, useTree);
+            case ILLUMINATION_LAMBERT:
+                return traceWith<LambertModel>(ray, depth, useTree);
+            default:
+                return traceWith<PhongModel>(ray, depth, useTree);
+        }
+    }
+
+    template <typename Model>
+    Color traceWith( Ray ray, int depth, bool useTree ) {
+        // one stack per thread, kept between pixels so it is only allocated once
+        static thread_local std::vector<secondaryRay> stack;
+
+        stack.clear();
+        stack.push_back( secondaryRay(ray, depth, 1.0) );
+
+        Color finalColor;
+
+        while ( !stack.empty() ) {
+            secondaryRay current = stack.back();
+            stack.pop_back();
+
+            finalColor += current.weight * shadeHit<Model>(current, useTree, stack);
+        }
+
+        return finalColor;
+    }
+
+    // Wavefront tracing, for a whole batch of rays at once: every stage runs
+    // over all of the rays before the next one starts. All rays are
+    // intersected, the hits are sorted by material and object so each
+    // material (and each mesh) is shaded in one go, the shadow rays of all
+    // the hits are traced together, then the lighting is done and the
+    // reflected and transmitted rays make the next, smaller, batch.
+    //
+    // Each ray adds weight times its color to colorMap[pixels[k]].
+    void traceWavefront( std::vector<Ray> &rays, std::vector<int> &pixels, int depth, double weight, std::vector<Color> &colorMap ) {
+        switch (illuminationModel) {
+            case ILLUMINATION_NONE:
+                std::cerr << "Error: World needs to have illumination setup before rendering." << std::endl;
+                exit(1);
+            case ILLUMINATION_PHONG_BLINN:
+                traceWavefrontWith<PhongBlinnModel>(rays, pixels, depth, weight, colorMap);
+                break;
+            case ILLUMINATION_LAMBERT:
+                traceWavefrontWith<LambertModel>(rays, pixels, depth, weight, colorMap);
+                break;
+            default:
+                traceWavefrontWith<PhongModel>(rays, pixels, depth, weight, colorMap);
+        }
+    }
 
-            // if object is emissive, return emissive color and end
-            if (objectHit->isEmissive()) {
-                return objectHit->getEmissiveColor();
+    template <typename Model>
+    void traceWavefrontWith( std::vector<Ray> &rays, std::vector<int> &pixels, int depth, double weight, std::vector<Color> &colorMap ) {
+        bool useTree = kd.exists();
+
+        std::vector<secondaryRay> stream;
+        std::vector<int> streamPixels(pixels);
+
+        for(std::vector<Ray>::iterator it = rays.begin() ; it < rays.end() ; ++it)
+            stream.push_back( secondaryRay(*it, depth, weight) );
+
+        while ( !stream.empty() ) {
+            int n = stream.size();
+
+            // intersect them all, keeping what each intersect found out about
+            // its hit (a mesh's triangle) for when it is shaded
+            std::vector<Object*> objectsHit(n);
+            std::vector<Point> pointsHit(n);
+            std::vector<HitHint> hints(n);
+
+            forEachRay(n, [&](int k) {
+                objectsHit[k] = findHit(stream[k].ray, useTree, pointsHit[k]);
+                hints[k] = lastHitHint();
+            }, WAVEFRONT_CHUNK);
+
+            // group them by the material and then the object they hit, the
+            // misses first
+            std::vector<int> order(n);
+            std::vector<int> materials(n);
+            for (int k = 0; k < n; ++k) {
+                order[k] = k;
+                materials[k] = (objectsHit[k] == NULL) ? -1 : objectsHit[k]->getMaterial();
             }
 
-            // shadow ray origin should be slightly  different to account for rounding errors
-            Vector normal = objectHit->getNormal(pointHit);
-            Point originShadowRay(pointHit.x + normal.x * 0.001,
-                                  pointHit.y + normal.y * 0.001,
-                                  pointHit.z + normal.z * 0.001 );
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+                if (materials[a] != materials[b])
+                    return materials[a] < materials[b];
+                return std::less<Object*>()(objectsHit[a], objectsHit[b]);
+            });
 
-            // the new function we will use
-            std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap = lightsReachedKdTree(originShadowRay, lightList);
+            // the surface at each hit, in that order, and its shadow rays
+            int chunks = (n + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK;
 
-            Vector view(pointHit, originRay, true);
+            std::vector<surfaceHit> surfaces(n);
+            std::vector<std::vector<shadowRay> > chunkShadows(chunks);
 
-            Color amb = ambientComponent( objectHit, backgroundRadiance, pointHit );
-            Color diff_spec = illuminate( objectHit, view, pointHit,
-                    objectHit->getNormal(pointHit), lightsAndPointsReachedMap);
+            std::vector<Color> colors(n);
+            std::vector<char> colored(n, 0);
 
-            Color finalColor = amb + diff_spec;
+            forEachRay(chunks, [&](int c) {
+                int last = std::min(n, (c + 1) * WAVEFRONT_CHUNK);
 
-            if ( depth > 1 ) {
-                double kr = objectHit->getKr();
-                double kt = objectHit->getKt();
+                hitColors(stream, objectsHit, pointsHit, order, c * WAVEFRONT_CHUNK, last, colors, colored);
 
-                if ( kr > 0 ) {
-                    // Direction of incoming ray
-                    Vector rayDir = ray.getDirection();
+                for (int o = c * WAVEFRONT_CHUNK; o < last; ++o) {
+                    int k = order[o];
+                    if (objectsHit[k] == NULL || objectsHit[k]->isEmissive())
+                        continue;
 
-                    // Reflection of the ray direction
-                    Vector reflectedDir = reflect(rayDir, objectHit->getNormal(pointHit), VECTOR_INCOMING );
+                    lastHitHint() = hints[k];
+                    surfaces[k] = surfaceAt(stream[k], objectsHit[k], pointsHit[k], useTree, colored[k] ? &colors[k] : NULL);
 
-                    // Recursion !
-                    finalColor += kr * spawnKdtree( Ray(originShadowRay, reflectedDir) , depth-1);
+                    addShadowRays(surfaces[k].shadowOrigin, k, useTree, chunkShadows[c]);
                 }
-                if ( kt > 0 ) {
-                    // Direction of incoming ray
-                    Vector rayDir = ray.getDirection();
-                    Vector objNormal = objectHit->getNormal(pointHit);
+            }, 1);
 
-                    Vector normal;
-                    double nit;
+            // every shadow ray of the batch in one stream, each chunk's
+            // rays in the order of its hits
+            std::vector<shadowRay> shadows;
+            std::vector<int> chunkStart(chunks + 1);
 
-                    Point transmittedRayOrigin;
+            for (int c = 0; c < chunks; ++c) {
+                chunkStart[c] = shadows.size();
+                shadows.insert(shadows.end(), chunkShadows[c].begin(), chunkShadows[c].end());
+                std::vector<shadowRay>().swap(chunkShadows[c]);
+            }
+            chunkStart[chunks] = shadows.size();
 
-                    // inside
-                    if (dot(-1 * rayDir,objNormal) < 0) {
-                        normal = -1.0 * objNormal;
-                        nit = objectHit->getNr() / nr;
+            forEachRay(shadows.size(), [&](int s) {
+                shadows[s].blocked = shadowBlocked(shadows[s].ray, shadows[s].light, shadows[s].lightDistance, useTree);
+            }, WAVEFRONT_CHUNK);
 
-                        transmittedRayOrigin = Point(pointHit.x + objNormal.x * 0.01,
-                                                     pointHit.y + objNormal.y * 0.01,
-                                                     pointHit.z + objNormal.z * 0.01 );
+            // then the lighting, each chunk keeps the rays it spawns
+            std::vector<Color> shaded(n);
+            std::vector<std::vector<secondaryRay> > next(chunks);
+            std::vector<std::vector<int> > nextPixels(chunks);
 
-                    } else { // outside
-                        normal = objNormal;
-                        nit = nr / objectHit->getNr();
+            forEachRay(chunks, [&](int c) {
+                int last = std::min(n, (c + 1) * WAVEFRONT_CHUNK);
+                int s = chunkStart[c];
 
-                        // the ray needs to go out a bit inside the object to be sure
-                        transmittedRayOrigin = Point(pointHit.x + objNormal.x * -0.01,
-                                                     pointHit.y + objNormal.y * -0.01,
-                                                     pointHit.z + objNormal.z * -0.01 );
-                    }
+                LightsReached lightsAndPointsReachedMap;
 
-                    double aux = 1.0 + (pow(nit,2) * (pow( dot(-1.0 * rayDir,normal) , 2) - 1.0));
+                for (int o = c * WAVEFRONT_CHUNK; o < last; ++o) {
+                    int k = order[o];
+                    unsigned int spawned = next[c].size();
 
-                    // If Total Internal Reflection
-                    if (aux < 0) {
-                        // Same thing as reflected ray
-                        Vector reflectedDir = reflect(rayDir, normal, VECTOR_INCOMING );
-                        finalColor += kt * spawnKdtree( Ray(transmittedRayOrigin, reflectedDir), depth-1);
+                    Color color;
+                    if (objectsHit[k] == NULL) {
+                        color = backgroundRadiance;
+                    } else if (objectsHit[k]->isEmissive()) {
+                        color = objectsHit[k]->getEmissiveColor();
                     } else {
-                        Vector transmittedDir = nit * rayDir + (nit * dot(-1.0 * rayDir,normal) - sqrt(aux) ) * normal;
-                        finalColor += kt * spawnKdtree( Ray(transmittedRayOrigin, transmittedDir), depth-1);
+                        lightsAndPointsReachedMap.clear();
+                        for (; s < chunkStart[c + 1] && shadows[s].hit == k; ++s)
+                            if (!shadows[s].blocked)
+                                lightsAndPointsReachedMap[shadows[s].light].push_back(shadows[s].lightPoint);
+
+                        color = lightAt<Model>(stream[k], objectsHit[k], pointsHit[k], surfaces[k], lightsAndPointsReachedMap, next[c]);
                     }
+
+                    shaded[k] = stream[k].weight * color;
+
+                    for (; spawned < next[c].size(); ++spawned)
+                        nextPixels[c].push_back(streamPixels[k]);
                 }
+            }, 1);
+
+            // several rays can end up in the same pixel, so this is not parallel
+            for (int k = 0; k < n; ++k)
+                colorMap[streamPixels[k]] += shaded[k];
+
+            stream.clear();
+            streamPixels.clear();
+
+            for (int c = 0; c < chunks; ++c) {
+                stream.insert(stream.end(), next[c].begin(), next[c].end());
+                streamPixels.insert(streamPixels.end(), nextPixels[c].begin(), nextPixels[c].end());
             }
-            return finalColor;
         }
     }
 
-    // Spawn will return the color we should use for the pixel in the ray
-    Color spawnIlluminated( Ray ray, int depth ) {
+    // The object colors of the hits order[first] to order[last - 1] that are
+    // on a procedural texture into colors (and colored set), each run of
+    // hits on the same object with one getColors call. The others are
+    // looked up one at a time with their normal, while the hit's triangle
+    // is known
+    void hitColors( std::vector<secondaryRay> &stream, const std::vector<Object*> &objectsHit, const std::vector<Point> &pointsHit,
+                    const std::vector<int> &order, int first, int last, std::vector<Color> &colors, std::vector<char> &colored ) {
+        std::vector<Point> points;
+        std::vector<double> footprints;
+        std::vector<Color> out;
+
+        int start = first;
+        while (start < last) {
+            Object *object = objectsHit[order[start]];
+
+            int end = start + 1;
+            while (end < last && objectsHit[order[end]] == object)
+                ++end;
+
+            if (object != NULL && !object->isEmissive() && object->getProceduralTexture() != NULL) {
+                points.clear();
+                footprints.clear();
+                for (int o = start; o < end; ++o) {
+                    int k = order[o];
+                    points.push_back(pointsHit[k]);
+                    footprints.push_back(pixelSpread * (stream[k].travelled + distance(stream[k].ray.getOrigin(), pointsHit[k])));
+                }
+
+                out.resize(end - start);
+                object->getColors(&points[0], &footprints[0], end - start, &out[0]);
+
+                for (int o = start; o < end; ++o) {
+                    colors[order[o]] = out[o - start];
+                    colored[order[o]] = 1;
+                }
+            }
+
+            start = end;
+        }
+    }
+
+    // body(k) for k in [0, n), on the pool with MULTI_THREADED
+    template <typename F>
+    void forEachRay( int n, F body, int grain ) {
+        #ifdef MULTI_THREADED
+            threadPool().parallelFor(0, n, body, grain);
+        #else
+            for (int k = 0; k < n; ++k)
+                body(k);
+        #endif
+    }
+
+    // Closest object the ray hits, NULL if none, pointHit is set to where
+    Object* findHit( Ray ray, bool useTree, Point &pointHit ) {
+        if (useTree) {
+            // walk through the tree, get the object the ray hits
+            return kd.traverse(ray, pointHit);
+        }
+
         Point originRay = ray.getOrigin();
-        Point intersection;
 
         std::vector<Point> vPoint;
         std::vector<double> vDist;
 
         // we will go through the objects in the world and look for intersections
         for(std::vector<Object*>::iterator it = objectList.begin() ; it < objectList.end() ; ++it) {
-            intersection = (*it)->intersect(ray);
+            Point intersection = (*it)->intersect(ray);
             vPoint.push_back( intersection );
             vDist.push_back( distance(originRay, intersection) );
         }
@@ -207,112 +525,166 @@ public:
         // we find the minimum distance on vDist, which would be closest intersection
         int objHit( indexMinElement(vDist) );
 
-        // if no object was hit
         if (objHit == -1) {
+            return NULL;
+        }
+
+        pointHit = vPoint[objHit];
+        return objectList[objHit];
+    }
+
+    // Color where the ray hits, without what is reflected or transmitted,
+    // those rays are pushed on the stack instead
+    template <typename Model>
+    Color shadeHit( secondaryRay &current, bool useTree, std::vector<secondaryRay> &stack ) {
+        Point pointHit;
+        Object* objectHit = findHit(current.ray, useTree, pointHit);
+
+        return shadeAt<Model>(current, objectHit, pointHit, useTree, stack);
+    }
+
+    template <typename Model>
+    Color shadeAt( secondaryRay &current, Object* objectHit, Point pointHit, bool useTree, std::vector<secondaryRay> &stack ) {
+        if (objectHit == NULL) {
             return backgroundRadiance;
-        } else {
-            Object* objectHit = objectList[objHit];
-            Point pointHit = vPoint[objHit];
+        }
 
-            // if object is emissive, return emissive color and end
-            if (objectHit->isEmissive()) {
-                return objectHit->getEmissiveColor();
-            }
+        // if object is emissive, return emissive color and end
+        if (objectHit->isEmissive()) {
+            return objectHit->getEmissiveColor();
+        }
 
-            // shadow ray origin should be slightly  different to account for rounding errors
-            Vector normal = objectHit->getNormal(pointHit);
-            Point originShadowRay(pointHit.x + normal.x * 0.01,
-                                  pointHit.y + normal.y * 0.01,
-                                  pointHit.z + normal.z * 0.01 );
+        surfaceHit surface = surfaceAt(current, objectHit, pointHit, useTree);
 
-            // the new function we will use
-            std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap = lightsReached(originShadowRay, lightList);
+        LightsReached lightsAndPointsReachedMap = useTree ?
+            lightsReachedKdTree(surface.shadowOrigin, lightList) : lightsReached(surface.shadowOrigin, lightList);
 
-            Vector view(pointHit, originRay, true);
+        return lightAt<Model>(current, objectHit, pointHit, surface, lightsAndPointsReachedMap, stack);
+    }
 
-            Color amb = ambientComponent( objectHit, backgroundRadiance, pointHit );
-            Color diff_spec = illuminate( objectHit, view, pointHit,
-                    objectHit->getNormal(pointHit), lightsAndPointsReachedMap);
+    // Normal, color and shadow ray origin at a hit on an object that isn't
+    // emissive. objectColor is the object's color at pointHit if it was
+    // already looked up
+    surfaceHit surfaceAt( secondaryRay &current, Object* objectHit, Point pointHit, bool useTree, const Color *objectColor = NULL ) {
+        surfaceHit surface;
 
-            Color finalColor = amb + diff_spec;
+        // the normal is fetched once, for the lighting and the secondary rays
+        surface.normal = objectHit->getNormal(pointHit);
 
-            // If lights hit is empty, it means the shadow ray might have hit something
-            // before reaching the light, i.e. an object
-            // In this case we should take into account if the object is transparent
-            /* TODO: This cheat for light through transparent objects still not fully working
-               I'm leaving it here for future Felipe to figure something out
-            if ( !allRaysHitLight(lightsAndPointsReachedMap) ) {
+        // for the textures' mip level
+        surface.travelled = current.travelled + distance(current.ray.getOrigin(), pointHit);
+        double footprint = pixelSpread * surface.travelled;
 
-                std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMapTransp = lightsReachedThroughTransparency(originShadowRay,
-                                                                                                                lightsAndPointsReachedMap);
+        // before the shadow rays, a mesh still knows which triangle was hit
+        surface.color = (objectColor != NULL) ? *objectColor : objectHit->getColor(pointHit, footprint);
 
-                Color diff_spec = illuminate( objectHit, view, pointHit,
-                        objectHit->getNormal(pointHit), lightsAndPointsReachedMapTransp);
+        // shadow ray origin should be slightly  different to account for rounding errors
+        double offset = useTree ? 0.001 : 0.01;
+        surface.shadowOrigin = Point(pointHit.x + surface.normal.x * offset,
+                                     pointHit.y + surface.normal.y * offset,
+                                     pointHit.z + surface.normal.z * offset );
 
-                finalColor += 0.8 * diff_spec;
-            }
-            */
+        return surface;
+    }
 
-            if ( depth > 1 ) {
-                double kr = objectHit->getKr();
-                double kt = objectHit->getKt();
+    // Color at a hit once its shadow rays are traced, lightsAndPointsReachedMap
+    // having the light points they reached. The reflected and transmitted
+    // rays are pushed on the stack
+    template <typename Model>
+    Color lightAt( secondaryRay &current, Object* objectHit, Point pointHit, const surfaceHit &surface,
+                   const LightsReached &lightsAndPointsReachedMap, std::vector<secondaryRay> &stack ) {
+        Ray ray = current.ray;
+        Point originRay = ray.getOrigin();
 
-                if ( kr > 0 ) {
-                    // Direction of incoming ray
-                    Vector rayDir = ray.getDirection();
+        Vector normal = surface.normal;
+        Point originShadowRay = surface.shadowOrigin;
+        double travelled = surface.travelled;
 
-                    // Reflection of the ray direction
-                    Vector reflectedDir = reflect(rayDir, objectHit->getNormal(pointHit), VECTOR_INCOMING );
+        Vector view(pointHit, originRay, true);
 
-                    // Recursion !
-                    finalColor += kr * spawnIlluminated( Ray(originShadowRay, reflectedDir) , depth-1);
-                }
-                if ( kt > 0 ) {
-                    // Direction of incoming ray
-                    Vector rayDir = ray.getDirection();
-                    Vector objNormal = objectHit->getNormal(pointHit);
+        Color amb = ambientComponent( objectHit, surface.color );
+        Color diff_spec = illuminate<Model>( objectHit, view, pointHit, normal, lightsAndPointsReachedMap, surface.color );
 
-                    Vector normal;
-                    double nit;
+        Color finalColor = amb + diff_spec;
 
-                    Point transmittedRayOrigin;
+        // If lights hit is empty, it means the shadow ray might have hit something
+        // before reaching the light, i.e. an object
+        // In this case we should take into account if the object is transparent
+        /* TODO: This cheat for light through transparent objects still not fully working
+           I'm leaving it here for future Felipe to figure something out
+        if ( !useTree && !allRaysHitLight(lightsAndPointsReachedMap) ) {
 
-                    // inside
-                    if (dot(-1 * rayDir,objNormal) < 0) {
-                        normal = -1.0 * objNormal;
-                        nit = objectHit->getNr() / nr;
+            std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMapTransp = lightsReachedThroughTransparency(originShadowRay,
+                                                                                                            lightsAndPointsReachedMap);
 
-                        transmittedRayOrigin = Point(pointHit.x + objNormal.x * 0.01,
-                                                     pointHit.y + objNormal.y * 0.01,
-                                                     pointHit.z + objNormal.z * 0.01 );
+            Color diff_spec = illuminate( objectHit, view, pointHit,
+                    normal, lightsAndPointsReachedMapTransp);
 
-                    } else { // outside
-                        normal = objNormal;
-                        nit = nr / objectHit->getNr();
+            finalColor += 0.8 * diff_spec;
+        }
+        */
 
-                        // the ray needs to go out a bit inside the object to be sure
-                        transmittedRayOrigin = Point(pointHit.x + objNormal.x * -0.01,
-                                                     pointHit.y + objNormal.y * -0.01,
-                                                     pointHit.z + objNormal.z * -0.01 );
-                    }
+        if ( current.depth > 1 ) {
+            double kr = objectHit->getKr();
+            double kt = objectHit->getKt();
+            double weight = current.weight;
+            int depth = current.depth;
 
-                    double aux = 1.0 + (pow(nit,2) * (pow( dot(-1.0 * rayDir,normal) , 2) - 1.0));
+            // 0 if the branch was cut off by the roulette
+            double reflectScale = (kr > 0) ? roulette(weight * kr) : 0.0;
+            double transmitScale = (kt > 0) ? roulette(weight * kt) : 0.0;
 
-                    // If Total Internal Reflection
-                    if (aux < 0) {
-                        // Same thing as reflected ray
-                        Vector reflectedDir = reflect(rayDir, normal, VECTOR_INCOMING );
-                        finalColor += kt * spawnIlluminated( Ray(transmittedRayOrigin, reflectedDir), depth-1);
-                    } else {
-                        Vector transmittedDir = nit * rayDir + (nit * dot(-1.0 * rayDir,normal) - sqrt(aux) ) * normal;
-                        finalColor += kt * spawnIlluminated( Ray(transmittedRayOrigin, transmittedDir), depth-1);
-                    }
-                }
+            // Direction of incoming ray
+            Vector rayDir = ray.getDirection();
+
+            if ( reflectScale > 0 ) {
+                // Reflection of the ray direction
+                Vector reflectedDir = reflect(rayDir, normal, VECTOR_INCOMING );
+
+                stack.push_back( secondaryRay(Ray(originShadowRay, reflectedDir), depth-1, weight * kr * reflectScale, travelled) );
             }
+            if ( transmitScale > 0 ) {
+                Vector facing;
+                double nit;
 
-            return finalColor;
+                Point transmittedRayOrigin;
+
+                // inside
+                if (dot(-1 * rayDir,normal) < 0) {
+                    facing = -1.0 * normal;
+                    nit = objectHit->getNr() / nr;
+
+                    transmittedRayOrigin = Point(pointHit.x + normal.x * 0.01,
+                                                 pointHit.y + normal.y * 0.01,
+                                                 pointHit.z + normal.z * 0.01 );
+
+                } else { // outside
+                    facing = normal;
+                    nit = nr / objectHit->getNr();
+
+                    // the ray needs to go out a bit inside the object to be sure
+                    transmittedRayOrigin = Point(pointHit.x + normal.x * -0.01,
+                                                 pointHit.y + normal.y * -0.01,
+                                                 pointHit.z + normal.z * -0.01 );
+                }
+
+                double aux = 1.0 + (pow(nit,2) * (pow( dot(-1.0 * rayDir,facing) , 2) - 1.0));
+
+                Vector transmittedDir;
+
+                // If Total Internal Reflection
+                if (aux < 0) {
+                    // Same thing as reflected ray
+                    transmittedDir = reflect(rayDir, facing, VECTOR_INCOMING );
+                } else {
+                    transmittedDir = nit * rayDir + (nit * dot(-1.0 * rayDir,facing) - sqrt(aux) ) * facing;
+                }
+
+                stack.push_back( secondaryRay(Ray(transmittedRayOrigin, transmittedDir), depth-1, weight * kt * transmitScale, travelled) );
+            }
         }
 
+        return finalColor;
     }
 /*
     Color spawnRayMarch ( Ray ray, int SAMPLE_NUM ) {
@@ -417,17 +789,52 @@ public:
         return attenuated + inscattering;
     }
 */
+    // Is anything that isn't a light between the origin of the shadow ray and
+    // the light, distOriginAndLight away? The tree works the distance out
+    // itself
+    bool shadowBlocked( Ray &ray, LightSource *light, double distOriginAndLight, bool useTree ) {
+        if (useTree)
+            return kd.traverseForLight(ray, light) != NULL;
+
+        Point originShadowRay = ray.getOrigin();
+
+        for(std::vector<Object*>::iterator itObj = objectList.begin() ; itObj < objectList.end() ; ++itObj) {
+            double distOriginIntersection = distance(originShadowRay, (*itObj)->intersect(ray));
+            if ( !(*itObj)->isEmissive() && distOriginIntersection != 0
+                && distOriginIntersection < distOriginAndLight) { // emissive object should not block, it's light
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // The shadow rays from originShadowRay of hit k of a wavefront batch, one
+    // to each point of each light that can reach it, in the same order
+    // lightsReached goes through them
+    void addShadowRays( Point originShadowRay, int k, bool useTree, std::vector<shadowRay> &shadows ) {
+        for(std::vector<LightSource*>::const_iterator it = lightList.begin() ; it < lightList.end() ; ++it) {
+            if( !(*it)->reaches(originShadowRay) )
+                continue;
+
+            // could be an area light
+            double distOriginAndLight = useTree ? 0 : (*it)->getMinDistance(originShadowRay);
+            std::vector<Point> pointsOnLightSurface = (*it)->getPos();
+            for(std::vector<Point>::iterator it2 = pointsOnLightSurface.begin() ; it2 < pointsOnLightSurface.end() ; ++it2) {
+                Vector dir( originShadowRay, (*it2), true );
+                shadows.push_back( shadowRay(Ray(originShadowRay, dir), *it, *it2, distOriginAndLight, k) );
+            }
+        }
+    }
+
     // This returns a map of which lights the shadow ray coming from originShadowRay can reach
     // and which points it actually hit on the light (necessary for area lights)
-    std::map<LightSource*, std::vector<Point> > lightsReached(Point originShadowRay, std::vector<LightSource*> lightList){
-        std::vector<LightSource*> lightsHit;
-        std::vector<Object*>::iterator itObj;
-
+    LightsReached lightsReached(Point originShadowRay, const std::vector<LightSource*> &lightList){
         std::map<LightSource*, std::vector<Point>> result;
         std::vector<Point> pointsHitOnLight;
 
         // For every light source, let's see if a ray from originShadowRay can reach it
-        for(std::vector<LightSource*>::iterator it = lightList.begin() ; it < lightList.end() ; ++it) {
+        for(std::vector<LightSource*>::const_iterator it = lightList.begin() ; it < lightList.end() ; ++it) {
 
             // If this ray can actually reach the lights
             // (can always reach a point light, maybe not a spot light)
@@ -440,15 +847,7 @@ public:
                     Vector dir( originShadowRay, (*it2), true );
                     Ray fromPointToLight(originShadowRay, dir);
 
-                    for(itObj = objectList.begin() ; itObj < objectList.end() ; ++itObj) {
-                        double distOriginIntersection = distance(originShadowRay, (*itObj)->intersect(fromPointToLight));
-                        if ( !(*itObj)->isEmissive() && distOriginIntersection != 0
-                            && distOriginIntersection < distOriginAndLight) { // emissive object should not block, it's light
-                            break;
-                        }
-                    }
-
-                    if ( itObj == objectList.end() ) { // if it went through the whole loop, then it hits the light!
+                    if ( !shadowBlocked(fromPointToLight, *it, distOriginAndLight, false) ) { // nothing in the way, then it hits the light!
                         pointsHitOnLight.push_back( *it2 );
                     }
                 }
@@ -465,15 +864,12 @@ public:
 
     // This returns a map of which lights the shadow ray coming from originShadowRay can reach
     // and which points it actually hit on the light (necessary for area lights)
-    std::map<LightSource*, std::vector<Point> > lightsReachedKdTree(Point originShadowRay, std::vector<LightSource*> lightList){
-        std::vector<LightSource*> lightsHit;
-        std::vector<Object*>::iterator itObj;
-
+    LightsReached lightsReachedKdTree(Point originShadowRay, const std::vector<LightSource*> &lightList){
         std::map<LightSource*, std::vector<Point>> result;
         std::vector<Point> pointsHitOnLight;
 
         // For every light source, let's see if a ray from originShadowRay can reach it
-        for(std::vector<LightSource*>::iterator it = lightList.begin() ; it < lightList.end() ; ++it) {
+        for(std::vector<LightSource*>::const_iterator it = lightList.begin() ; it < lightList.end() ; ++it) {
 
             // If this ray can actually reach the lights
             // (can always reach a point light, maybe not a spot light)
@@ -484,9 +880,7 @@ public:
                     Vector dir( originShadowRay, (*it2), true );
                     Ray fromPointToLight(originShadowRay, dir);
 
-                    Object* objectHit = kd.traverseForLight(fromPointToLight,*it);
-
-                    if ( objectHit == NULL ) { // if it went through the whole loop, then it hits the light!
+                    if ( !shadowBlocked(fromPointToLight, *it, 0, true) ) { // nothing in the way, then it hits the light!
                         pointsHitOnLight.push_back( *it2 );
                     }
                 }
@@ -506,14 +900,14 @@ public:
     // because if they are, then nothing needs to be done
     // but if they are not, maybe one of the rays that tried to hit the samples
     // went through a transparent object, so we check further
-    bool allRaysHitLight(std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap) {
+    bool allRaysHitLight(const LightsReached &lightsAndPointsReachedMap) {
         if (lightsAndPointsReachedMap.empty()){
             return false;
         }
 
-        for (std::map<LightSource*, std::vector<Point> >::iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
+        for (LightsReached::const_iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
             LightSource *lightHit = (it->first);
-            std::vector<Point> pointsHit = (it->second);
+            const std::vector<Point> &pointsHit = (it->second);
 
             if (pointsHit.size() < lightHit->getNumSamplesOnSurface()) {
                 // If points hit is less than the num samples of surface, then dis difference
@@ -528,8 +922,8 @@ public:
     // This returns a vector of which lights the shadow ray coming from originShadowRay can reach
     // But in this case, if there is a transparent object in the way, we consider that the
     // light is still reachable
-    std::map<LightSource*, std::vector<Point> > lightsReachedThroughTransparency(Point originShadowRay,
-                            std::map<LightSource*, std::vector<Point> > lightsAndPointsReachedMap) {
+    LightsReached lightsReachedThroughTransparency(Point originShadowRay,
+                            const LightsReached &lightsAndPointsReachedMap) {
         std::vector<Object*>::iterator itObj;
 
         std::map<LightSource*, std::vector<Point>> result;
@@ -577,9 +971,9 @@ public:
 
 
 
-        for (std::map<LightSource*, std::vector<Point> >::iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
+        for (LightsReached::const_iterator it=lightsAndPointsReachedMap.begin(); it!=lightsAndPointsReachedMap.end(); ++it) {
             LightSource *lightHit = (it->first);
-            std::vector<Point> pointsHit = (it->second);
+            const std::vector<Point> &pointsHit = (it->second);
 
             if (pointsHit.size() < lightHit->getNumSamplesOnSurface()) {
                 // If points hit is less than the num samples of surface, then dis difference